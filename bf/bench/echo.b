@@ -0,0 +1,4 @@
+Copies stdin to stdout one byte at a time; the cell is cleared before
+each read so that EOF (which leaves the cell unchanged) ends the loop
+
+,[.[-],]
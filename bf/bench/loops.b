@@ -0,0 +1,8 @@
+Nested counting loops: 8^8 passes through a loop body that is not one of
+the recognised idioms so this measures plain instruction dispatch
+
+++++++++[>++++++++<-]>
+[>++++++++[>++++++++[>++++++++[>++++++++[>++++++++[>++++++++
+  [>+>[-]<<-]
+<-]<-]<-]<-]<-]<-]
+++++++++++.
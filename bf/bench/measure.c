@@ -0,0 +1,57 @@
+/*
+ * measure.c
+ *
+ * Runs a command with stdin redirected from a file and stdout discarded,
+ * then prints its wall time in seconds and peak RSS in kilobytes.
+ * Used by run.sh for `make bench`.
+ *
+ * Usage: measure <input> <command> [args...]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    fprintf(stderr, "Usage: %s <input> <command> [args...]\n", argv[0]);
+    return 1;
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return 1;
+  }
+  if (pid == 0) {
+    int in = open(argv[1], O_RDONLY);
+    int out = open("/dev/null", O_WRONLY);
+    if (in < 0 || out < 0) {
+      perror("open");
+      _exit(127);
+    }
+    dup2(in, STDIN_FILENO);
+    dup2(out, STDOUT_FILENO);
+    execvp(argv[2], argv + 2);
+    perror("execvp");
+    _exit(127);
+  }
+
+  int status;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) < 0) {
+    perror("wait4");
+    return 1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double wall = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("%.6f %ld\n", wall, usage.ru_maxrss);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
@@ -0,0 +1,9 @@
+Copy and multiply loops: each pass spreads a value over three cells and
+gathers it back so this measures the multiply and clear instructions
+
+++++++++[>++++++++<-]>
+[>++++++++[>++++++++[>++++++++[>++++++++[>++++++++[
+  >++++++++++++++++++++++++++++++
+  [->+>++>+++<<<]>[-<+>]>[-<<+>>]>[-<<<+>>>]<<<[-]
+<-]<-]<-]<-]<-]<-]
+++++++++++.
@@ -0,0 +1,47 @@
+#!/bin/sh
+#
+# Benchmark runner for `make bench`.
+#
+# Runs every bench/*.b program on each engine (switch, threaded, jit and
+# the executable built by -c) and prints one JSON object per run:
+#
+#   {"program": "loops", "engine": "jit", "wall_s": 0.071, "instructions": 115043719,
+#    "ips": 1620333228, "peak_rss_kb": 1664}
+#
+# "instructions" is the number of IR instructions the program executes,
+# counted once with --count; "ips" divides it by the wall time of the run.
+# A program reads bench/<name>.in if present, otherwise a generated 16 MB
+# text stream. Other programs (mandelbrot.b, hanoi.b, ...) can be dropped
+# into bench/ and are picked up the same way.
+#
+# Usage: run.sh <bf> <measure>
+
+BF=$1
+MEASURE=$2
+DIR=$(dirname "$0")
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+yes "The quick brown fox jumps over the lazy dog" | head -c 16777216 > "$TMP/input"
+
+for program in "$DIR"/*.b; do
+  name=$(basename "$program" .b)
+  input="$TMP/input"
+  [ -f "$DIR/$name.in" ] && input="$DIR/$name.in"
+
+  instructions=$("$BF" -f "$program" --count < "$input" 2>&1 >/dev/null | awk '/instructions executed/ { print $1 }')
+  "$BF" -c "$program" "$TMP/$name" > /dev/null 2>&1 || rm -f "$TMP/$name"
+
+  for engine in switch threaded jit c; do
+    if [ "$engine" = c ]; then
+      [ -x "$TMP/$name" ] || continue
+      set -- "$TMP/$name"
+    else
+      set -- "$BF" -f "$program" --engine=$engine
+    fi
+    "$MEASURE" "$input" "$@" | awk -v p="$name" -v e="$engine" -v n="${instructions:-0}" '{
+      printf "{\"program\": \"%s\", \"engine\": \"%s\", \"wall_s\": %s, \"instructions\": %d, \"ips\": %.0f, \"peak_rss_kb\": %d}\n",
+             p, e, $1, n, ($1 > 0 ? n / $1 : 0), $2
+    }'
+  done
+done
@@ -0,0 +1,9 @@
+Scan loops: marks 30000 cells then sweeps from one end of the run to the
+other and back 20000 times
+
+>++++++++++[<++++++++++>-]<[>+++<-]>[<++++++++++>-]<[>++++++++++<-]>
+stretch the counter into a run of ones in cells 1 to 30000
+[[->+<]+>-]
+>>++++++++++[<++++++++++>-]<[>++++++++++<-]>[<++++++++++++++++++++>-]<
+[<<[<]>[>]>-]
+++++++++++.
@@ -3,31 +3,180 @@
 #include <stdint.h>
 #include <string.h>
 #include <signal.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #define VERSION "0.3"
 #define TAPESIZE 16777216
+/* Furthest, in cells, any instruction reaches from the last cell it was checked on */
+#define TAPE_REACH 65536
 
-int stack[TAPESIZE], stack_ptr;
-int loops[TAPESIZE], source_ptr, source_length, user_input;
-short int tape[TAPESIZE], cell, max_cell_used = 0;
-char source[TAPESIZE];
-int debug_counter = 1, memory_counter = 1;
+#if defined(__GNUC__) || defined(__clang__)
+#define HAVE_COMPUTED_GOTO
+#endif
+
+#if defined(__x86_64__) && defined(__unix__)
+#define HAVE_JIT
+#endif
+
+/* Instructions of the intermediate representation built by CompileSource */
+enum {
+  OP_ADD,         /* tape[cell + offset] += arg */
+  OP_SUB,         /* tape[cell + offset] -= arg, saturating at 0 */
+  OP_MOVE,        /* cell += arg, cell + offset is the furthest cell reached */
+  OP_OUT,         /* output tape[cell + offset], arg times */
+  OP_IN,          /* tape[cell + offset] = next input byte */
+  OP_JZ,          /* jump past the matching OP_JNZ (arg) if tape[cell] is 0 */
+  OP_JNZ,         /* jump back to the matching OP_JZ (arg) if tape[cell] is nonzero */
+  OP_DEBUG_CELL,  /* # */
+  OP_DEBUG_TAPE,  /* @ */
+  OP_CLEAR,       /* [-] or [+]: tape[cell] = 0 */
+  OP_SCAN,        /* [>] or [<]: move by arg until tape[cell] is 0 */
+  OP_MUL          /* tape[cell + offset] += tape[cell] * arg, used for [->+<] style loops */
+};
+
+typedef struct {
+  uint8_t op;
+  int arg;
+  int offset;
+} Instr;
+
+/* Bytes [begin, end) of the source an instruction was compiled from */
+typedef struct {
+  size_t begin, end;
+} SourceSpan;
+
+/*
+  All buffers are sized on demand. The tape is an mmap'd region of
+  tape_size cells between two PROT_NONE guards of TAPE_REACH cells: the
+  kernel only backs the pages a program touches, and running off either
+  end faults into handle_sigsegv instead of corrupting memory.
+  select_cells rounds tape_size up to a whole number of pages for that.
+  Moves are folded and cells addressed at an offset, so a single access
+  could jump over a guard of one page: CompileSource keeps every offset
+  and move within TAPE_REACH of a cell that was accessed since, see
+  CheckReach.
+  The state of a run is thread-local, so that every --batch worker has
+  its own tape and I/O; the program itself is shared.
+ */
+int *stack, stack_ptr, stack_capacity;
+size_t *stack_bytes, source_ptr, source_length, source_capacity;
+_Thread_local void *tape;
+_Thread_local int cell, max_cell_used, user_input;
+_Thread_local sigjmp_buf *run_abort;   /* where a --batch run goes on a fault */
+size_t tape_size = TAPESIZE, tape_page, tape_guard;
+const char *source;      /* program text: source_buffer or a mapped file */
+char *source_buffer;
+Instr *program;
+int program_length, program_capacity, move_pending, move_peak;
+size_t move_begin = SIZE_MAX, move_end;
+_Thread_local int debug_counter = 1, memory_counter = 1;
+
+/*
+  Program I/O goes through these buffers instead of one stdio call per
+  byte. Output is flushed when the buffer fills, before input is read,
+  at the end of a run and, when it is a terminal, on every newline.
+  A run reads in_fd and writes out_file: stdin and stdout, or the files
+  of one --batch input.
+ */
+_Thread_local char out_buffer[1 << 16], in_buffer[1 << 16];
+_Thread_local int out_length, out_interactive, in_pos, in_length, in_fd;
+_Thread_local FILE *out_file;
+
+/* --batch: inputs run by batch_worker threads, --jobs at a time */
+char **batch_inputs;
+int batch_count, batch_jobs;
+atomic_int batch_next, batch_failed;
+
+/* Execution engines, selected with --engine= */
+enum { ENGINE_SWITCH, ENGINE_THREADED, ENGINE_JIT };
+int engine = ENGINE_SWITCH;
+
+/*
+  Cells are cell_bits wide and either wrap around or, by default, have '-'
+  stop at 0. Each combination has its own engines, generated from
+  cells.h; cells points at the ones in use.
+ */
+typedef struct {
+  void (*run_switch)();
+  void (*run_counted)();
+  void (*run_profiled)();
+  void (*run_threaded)();
+#ifdef HAVE_JIT
+  void *jit_input, *jit_scan, *jit_debug_cell, *jit_debug_tape;
+#endif
+} CellEngine;
+
+const CellEngine *cells;
+int cell_bits = 16, cell_wrap;
+size_t cell_size = sizeof(short int);
+
+/* --count: run the counting switch engine and report the total */
+int count_instructions;
+unsigned long long executed_instructions;
+
+/*
+  --profile[=file]: CompileSource records the source span of every
+  instruction in spans[], the profiling switch engine counts executions
+  per instruction and times top-level loops, and print_profile writes
+  the report (to stderr by default).
+ */
+int profile;
+const char *profile_filename;
+SourceSpan *spans;
+unsigned long long *profile_counts;
+double *profile_time;
+int profile_depth;
+double profile_enter;
+
+/* Optimization flag passed to gcc by -c */
+const char *c_optimization = "-O2";
 
 #define COLOR_RESET   "\x1b[0m"
 #define COLOR_GREEN   "\x1b[32m"
 #define COLOR_YELLOW  "\x1b[33m"
 #define COLOR_RED     "\x1b[31m"
 
-void InitLoops();
+int CompileSource();
+void FlushMoves();
+void CheckReach();
+int OptimizeLoop(int start);
+void report_bracket(size_t offset, const char *message, const char *hint);
+void RunProfiled();
+void print_profile();
+void select_cells();
+void RunJit();
 void ExecuteSource();
+int parse_options(int argc, char **argv);
+void out_flush();
+int in_byte();
+void init_tape();
+void reset_tape();
+void source_reserve(size_t length);
 void handle_sigint(int sig);
+void handle_sigsegv(int sig, siginfo_t *info, void *context);
 void print_help();
+void load_file(const char *filename);
 void read_file(const char *filename);
+int run_batch(const char *filename, int count, char **inputs);
+void RunProgram();
 void bf_to_c(const char *input_filename, const char *output_filename);
 void compile_c_to_executable(const char *c_filename, const char *executable_filename);
 
 int main(int argc, char **argv) {
   signal(SIGINT, handle_sigint);
+  out_file = stdout;
+  out_interactive = isatty(STDOUT_FILENO);
+  atexit(out_flush);
+  argc = parse_options(argc, argv);
+  select_cells();
 
   if (argc > 1) {
     if (strcmp(argv[1], "-h") == 0) {
@@ -40,6 +189,18 @@ int main(int argc, char **argv) {
       }
       read_file(argv[2]);
       return 0;
+    } else if (strcmp(argv[1], "--batch") == 0) {
+      if (argc < 3) {
+        fprintf(stderr, COLOR_RED "Error: No file specified.\n" COLOR_RESET);
+        return 1;
+      }
+      return run_batch(argv[2], argc - 3, argv + 3);
+    } else if (strcmp(argv[1], "-j") == 0) {
+      engine = ENGINE_JIT;
+      if (argc > 2) {
+        read_file(argv[2]);
+        return 0;
+      }
     } else if (strcmp(argv[1], "-t") == 0) {
       if (argc < 3) {
         fprintf(stderr, COLOR_RED "Error: No file specified.\n" COLOR_RESET);
@@ -60,120 +221,960 @@ int main(int argc, char **argv) {
   }
 
   printf("\n    MiniBf %s\n", VERSION);
-  printf("\n    TAPE SIZE: %d", TAPESIZE);
-  printf("\n    CELL SIZE: 0-32767\n");
+  printf("\n    TAPE SIZE: %zu", tape_size);
+  printf("\n    CELL SIZE: 0-%llu (%s)\n", (1ULL << (cell_bits - !cell_wrap)) - 1, cell_wrap ? "wrapping" : "saturating");
   printf("\n    Input 'bf -h' for help\n\n");
 
-  char c;
+  int c;
   while (1) {
     source_length = 0;
-    memset(source, 0, sizeof(source));
-    while (source_length < TAPESIZE - 1 && (c = getchar()) != EOF) {
-      source[source_length++] = c;
+    while ((c = in_byte()) != EOF) {
+      source_reserve(source_length + 1);
+      source_buffer[source_length++] = c;
     }
+    source = source_buffer;
 
-    if (c == EOF) {
-      if (feof(stdin)) {
-        clearerr(stdin);
-        ExecuteSource();
-        memset(tape, 0, sizeof(tape));
-        cell = 0;
-        max_cell_used = 0;
-        debug_counter = 1;
-        memory_counter = 1;
+    ExecuteSource();
+    reset_tape();
+    cell = 0;
+    max_cell_used = 0;
+    debug_counter = 1;
+    memory_counter = 1;
+
+    /* Only a terminal has more to read after Ctrl + D */
+    if (!isatty(STDIN_FILENO)) break;
+  }
+
+  return 0;
+}
+
+/*
+  Consumes the --option=value arguments, which may appear anywhere on the
+  command line, and returns the number of remaining arguments.
+ */
+int parse_options(int argc, char **argv) {
+  int n = 1;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--count") == 0) {
+      count_instructions = 1;
+    } else if (strcmp(argv[i], "--profile") == 0) {
+      profile = 1;
+    } else if (strncmp(argv[i], "--profile=", 10) == 0) {
+      profile = 1;
+      profile_filename = argv[i] + 10;
+    } else if (strncmp(argv[i], "--engine=", 9) == 0) {
+      const char *name = argv[i] + 9;
+      if (strcmp(name, "switch") == 0) {
+        engine = ENGINE_SWITCH;
+      } else if (strcmp(name, "threaded") == 0) {
+#ifndef HAVE_COMPUTED_GOTO
+        fprintf(stderr, COLOR_YELLOW "Warning: threaded engine not supported by this compiler, using switch.\n" COLOR_RESET);
+#endif
+        engine = ENGINE_THREADED;
+      } else if (strcmp(name, "jit") == 0) {
+#ifndef HAVE_JIT
+        fprintf(stderr, COLOR_YELLOW "Warning: JIT not supported on this platform, using threaded.\n" COLOR_RESET);
+#endif
+        engine = ENGINE_JIT;
       } else {
-        break;
+        fprintf(stderr, COLOR_RED "Error: Unknown engine %s.\n" COLOR_RESET, name);
+        exit(1);
+      }
+    } else if (strncmp(argv[i], "--cell=", 7) == 0) {
+      cell_bits = atoi(argv[i] + 7);
+      if (cell_bits != 8 && cell_bits != 16 && cell_bits != 32) {
+        fprintf(stderr, COLOR_RED "Error: Cells can be 8, 16 or 32 bits, not %s.\n" COLOR_RESET, argv[i] + 7);
+        exit(1);
+      }
+    } else if (strncmp(argv[i], "--overflow=", 11) == 0) {
+      const char *name = argv[i] + 11;
+      if (strcmp(name, "wrap") == 0) {
+        cell_wrap = 1;
+      } else if (strcmp(name, "saturate") == 0) {
+        cell_wrap = 0;
+      } else {
+        fprintf(stderr, COLOR_RED "Error: Unknown overflow behaviour %s.\n" COLOR_RESET, name);
+        exit(1);
+      }
+    } else if (strncmp(argv[i], "--jobs=", 7) == 0) {
+      batch_jobs = atoi(argv[i] + 7);
+      if (batch_jobs <= 0) {
+        fprintf(stderr, COLOR_RED "Error: Invalid number of jobs %s.\n" COLOR_RESET, argv[i] + 7);
+        exit(1);
       }
+    } else if (strncmp(argv[i], "--tape=", 7) == 0) {
+      char *end;
+      long long cells = strtoll(argv[i] + 7, &end, 10);
+      /* cell is an int, and so is a cell plus TAPE_REACH */
+      if (*end || cells <= 0 || cells > INT_MAX - 2 * TAPE_REACH) {
+        fprintf(stderr, COLOR_RED "Error: Invalid tape size %s.\n" COLOR_RESET, argv[i] + 7);
+        exit(1);
+      }
+      tape_size = cells;
+    } else if (strncmp(argv[i], "-O", 2) == 0) {
+      // Pasted into the gcc command line, so only the levels gcc knows get through
+      if (!argv[i][2] || argv[i][3] || !strchr("0123sgz", argv[i][2])) {
+        fprintf(stderr, COLOR_RED "Error: Invalid optimization level %s.\n" COLOR_RESET, argv[i]);
+        print_help();
+        exit(1);
+      }
+      c_optimization = argv[i];
+    } else {
+      argv[n++] = argv[i];
     }
   }
-
-  return 0;
+  argv[n] = NULL;
+  return n;
 }
 
-void read_file(const char *filename) {
-  FILE *file = fopen(filename, "r");
-  if (!file) {
+/*
+  Makes a file the program text. Regular files are mapped, so CompileSource
+  parses them in place without a copy; anything else (pipes, devices) is
+  read into source_buffer in chunks.
+ */
+void load_file(const char *filename) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
     fprintf(stderr, COLOR_RED "Error: Could not open file %s\n" COLOR_RESET, filename);
     exit(1);
   }
 
-  source_length = fread(source, 1, TAPESIZE, file);
-  fclose(file);
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      madvise(map, st.st_size, MADV_SEQUENTIAL);
+      source = map;
+      source_length = st.st_size;
+      close(fd);
+      return;
+    }
+  }
 
+  ssize_t n;
+  source_length = 0;
+  do {
+    source_reserve(source_length + 65536);
+    n = read(fd, source_buffer + source_length, 65536);
+    if (n > 0) source_length += n;
+  } while (n > 0);
+  source = source_buffer;
+  close(fd);
+}
+
+void read_file(const char *filename) {
+  load_file(filename);
   ExecuteSource();
 }
 
-void InitLoops() {
+/*
+  Appends an instruction compiled from the current source byte, or
+  grows the span of the last one when a byte is folded into it.
+ */
+static inline void emit_instr(Instr instr) {
+  if (spans) spans[program_length] = (SourceSpan){source_ptr, source_ptr + 1};
+  program[program_length++] = instr;
+}
+
+static inline void extend_span(Instr *last) {
+  last->arg++;
+  if (spans) spans[last - program].end = source_ptr + 1;
+}
+
+/* Gives instructions from..program_length the span of a replaced loop */
+static void mark_spans(int from, size_t begin, size_t end) {
+  if (!spans) return;
+  for (int i = from; i < program_length; i++) spans[i] = (SourceSpan){begin, end};
+}
+
+/*
+  Translates source[] into program[] in a single pass.
+  Runs of '+' and '-' are folded into a single instruction and bytes which
+  are not commands are dropped. Pointer movement is deferred: instructions
+  address tape[cell + offset] and the accumulated movement is only emitted
+  as one OP_MOVE before a loop boundary or a debug command.
+  Brackets are matched on the way, each jump holding the index of the
+  other end of its loop. Returns 0 if they are unbalanced.
+ */
+int CompileSource() {
+  int ok = 1;
+  program_length = 0;
   stack_ptr = 0;
+  move_pending = move_peak = 0;
   for (source_ptr = 0; source_ptr < source_length; source_ptr++) {
-    if (source[source_ptr] == '[') stack[stack_ptr++] = source_ptr;
-    if (source[source_ptr] == ']') {
+    char c = source[source_ptr];
+    /* Any byte adds at most three instructions (a flushed OP_MOVE, a check and itself) */
+    if (program_length + 3 > program_capacity) {
+      program_capacity = program_capacity ? program_capacity * 2 : 4096;
+      program = realloc(program, program_capacity * sizeof(Instr));
+      if (profile) spans = realloc(spans, program_capacity * sizeof(SourceSpan));
+      if (!program || (profile && !spans)) {
+        fprintf(stderr, COLOR_RED "Error: Could not allocate memory.\n" COLOR_RESET);
+        exit(1);
+      }
+    }
+    Instr *last = program_length ? &program[program_length - 1] : NULL;
+    switch (c) {
+    case '+':
+      if (last && last->op == OP_ADD && last->offset == move_pending) extend_span(last);
+      else emit_instr((Instr){OP_ADD, 1, move_pending});
+      break;
+    case '-':
+      if (last && last->op == OP_SUB && last->offset == move_pending) extend_span(last);
+      else emit_instr((Instr){OP_SUB, 1, move_pending});
+      break;
+    case '>':
+      if (++move_pending > move_peak) move_peak = move_pending;
+      if (move_begin == SIZE_MAX) move_begin = source_ptr;
+      move_end = source_ptr + 1;
+      if (move_pending == TAPE_REACH) CheckReach();
+      break;
+    case '<':
+      move_pending--;
+      if (move_begin == SIZE_MAX) move_begin = source_ptr;
+      move_end = source_ptr + 1;
+      if (move_pending == -TAPE_REACH) CheckReach();
+      break;
+    case '.':
+      if (last && last->op == OP_OUT && last->offset == move_pending) extend_span(last);
+      else emit_instr((Instr){OP_OUT, 1, move_pending});
+      break;
+    case ',': emit_instr((Instr){OP_IN, 0, move_pending}); break;
+    case '[':
+      FlushMoves();
+      if (stack_ptr == stack_capacity) {
+        stack_capacity = stack_capacity ? stack_capacity * 2 : 256;
+        stack = realloc(stack, stack_capacity * sizeof(int));
+        stack_bytes = realloc(stack_bytes, stack_capacity * sizeof(size_t));
+        if (!stack || !stack_bytes) {
+          fprintf(stderr, COLOR_RED "Error: Could not allocate memory.\n" COLOR_RESET);
+          exit(1);
+        }
+      }
+      stack_bytes[stack_ptr] = source_ptr;
+      stack[stack_ptr++] = program_length;
+      emit_instr((Instr){OP_JZ, 0, 0});
+      break;
+    case ']':
       if (!stack_ptr) {
-        fprintf(stderr, COLOR_RED "\n\nError: couldn't find matching '[' for ']' at byte %d\n" COLOR_RESET, source_ptr);
-        fprintf(stderr, "%s\n", source);
-        for (int i = 0; i < source_ptr; i++) fprintf(stderr, " ");
-        fprintf(stderr, COLOR_RED "^ missing '['\n" COLOR_RESET);
+        report_bracket(source_ptr, "couldn't find matching '[' for ']'", "^ missing '['");
+        ok = 0;
+        break;
+      }
+      int start = stack[--stack_ptr];
+      if (OptimizeLoop(start)) {
+        move_begin = SIZE_MAX;
+        mark_spans(start, stack_bytes[stack_ptr], source_ptr + 1);
       } else {
-        --stack_ptr;
-        loops[source_ptr] = stack[stack_ptr];
-        loops[stack[stack_ptr]] = source_ptr;
+        FlushMoves();
+        program[start].arg = program_length;
+        emit_instr((Instr){OP_JNZ, start, 0});
+        if (spans) spans[start] = spans[program_length - 1] = (SourceSpan){stack_bytes[stack_ptr], source_ptr + 1};
       }
+      break;
+    case '#':
+      FlushMoves();
+      emit_instr((Instr){OP_DEBUG_CELL, 0, 0});
+      break;
+    case '@':
+      /* It reads no cell of its own, so the next offsets would not be checked */
+      CheckReach();
+      emit_instr((Instr){OP_DEBUG_TAPE, 0, 0});
+      break;
+    default: break;
     }
   }
+  FlushMoves();
 
   if (stack_ptr > 0) {
-    fprintf(stderr, COLOR_RED "\n\nError: couldn't find matching ']' for '[' at byte %d\n" COLOR_RESET, stack[--stack_ptr]);
-    fprintf(stderr, "%s\n", source);
-    for (int i = 0; i < stack[stack_ptr]; i++) fprintf(stderr, " ");
-    fprintf(stderr, COLOR_RED "^ missing ']'\n" COLOR_RESET);
+    report_bracket(stack_bytes[stack_ptr - 1], "couldn't find matching ']' for '['", "^ missing ']'");
+    ok = 0;
   }
+  return ok;
 }
 
-void ExecuteSource() {
-  InitLoops();
-  for (source_ptr = 0; source_ptr < source_length; source_ptr++) {
-    switch (source[source_ptr]) {
-    case '+': tape[cell]++; break;
-    case '-': if (tape[cell] > 0) tape[cell]--; break;
-    case '<': cell--; break;
-    case '>': cell++; if (cell > max_cell_used) max_cell_used = cell; break;
-    case ',':
-      user_input = getchar();
-      if (user_input == EOF) {
-        //DO NOTHING
-      } else {
-        tape[cell] = user_input;
-        if (tape[cell] == '\n') {
-          tape[cell] = 10;
-        }
+/*
+  Prints a bracket error with the line of the source it occurred on
+  (at most 80 bytes of it) and a marker under the offending byte.
+ */
+void report_bracket(size_t offset, const char *message, const char *hint) {
+  size_t begin = offset, end = offset;
+  while (begin > 0 && source[begin - 1] != '\n' && offset - begin < 60) begin--;
+  while (end < source_length && source[end] != '\n' && end - begin < 80) end++;
+  fprintf(stderr, COLOR_RED "\n\nError: %s at byte %zu\n" COLOR_RESET, message, offset);
+  fprintf(stderr, "%.*s\n", (int)(end - begin), source + begin);
+  for (size_t i = begin; i < offset; i++) fprintf(stderr, " ");
+  fprintf(stderr, COLOR_RED "%s\n" COLOR_RESET, hint);
+}
+
+/*
+  Emits the movement deferred by CompileSource as a single OP_MOVE.
+  Its offset is the furthest cell to the right that was addressed on the
+  way, so that max_cell_used stays exact.
+ */
+void FlushMoves() {
+  if (move_pending || move_peak > 0) {
+    if (spans) spans[program_length] = (SourceSpan){move_begin, move_end};
+    program[program_length++] = (Instr){OP_MOVE, move_pending, move_peak};
+  }
+  move_pending = move_peak = 0;
+  move_begin = SIZE_MAX;
+}
+
+/*
+  Flushes the moves and accesses the cell they lead to (an OP_ADD of 0),
+  which faults if it is in a guard. Every other OP_MOVE is followed by an
+  instruction reading tape[cell], a jump or the loop that replaced it, so
+  an offset never reaches more than TAPE_REACH cells past a cell that was
+  on the tape. Only a run of TAPE_REACH moves, or '@', needs this.
+ */
+void CheckReach() {
+  FlushMoves();
+  emit_instr((Instr){OP_ADD, 0, 0});
+}
+
+/*
+  Called on ']' before the OP_JNZ is emitted. If the loop, which begins
+  at the OP_JZ at start, is one of the common idioms below,
+  it is replaced with a single instruction (or a short sequence).
+  - [-], [+]          OP_CLEAR
+  - [>], [<<]         OP_SCAN
+  - [->+>++<<]        OP_MUL for each target cell, then OP_CLEAR
+  Returns 1 if the loop was replaced.
+ */
+int OptimizeLoop(int start) {
+  Instr *body = &program[start + 1];
+  int body_length = program_length - start - 1;
+  for (int i = 0; i < body_length; i++) {
+    if (body[i].op != OP_ADD && body[i].op != OP_SUB) return 0;
+  }
+
+  if (body_length == 0) {
+    if (!move_pending) return 0;
+    program[start] = (Instr){OP_SCAN, move_pending, 0};
+    program_length = start + 1;
+    move_pending = move_peak = 0;
+    return 1;
+  }
+  if (move_pending) return 0;
+
+  if (body_length == 1 && body[0].offset == 0) {
+    /* An odd step reaches 0 from any value; '-' also stops there when saturating */
+    if (body[0].arg % 2 || (body[0].op == OP_SUB && !cell_wrap)) {
+      program[start] = (Instr){OP_CLEAR, 0, 0};
+      program_length = start + 1;
+      move_peak = 0;
+      return 1;
+    }
+    return 0;
+  }
+
+  /* Multiply loop: no net movement, the loop cell is decremented exactly once */
+  /* and, with saturating cells, every other cell touched only by '+' or only by '-'. */
+  int offsets[16], deltas[16], touched = 0, counter = 0;
+  for (int i = 0; i < body_length; i++) {
+    int delta = body[i].op == OP_ADD ? body[i].arg : -body[i].arg;
+    if (body[i].offset == 0) {
+      if (counter || delta != -1) return 0;
+      counter = 1;
+      continue;
+    }
+    int j = 0;
+    while (j < touched && offsets[j] != body[i].offset) j++;
+    if (j == touched) {
+      if (touched == 16) return 0;
+      offsets[touched] = body[i].offset;
+      deltas[touched++] = 0;
+    }
+    if (!cell_wrap && (long)deltas[j] * delta < 0) return 0;
+    deltas[j] += delta;
+  }
+  if (!counter) return 0;
+
+  program_length = start;
+  for (int j = 0; j < touched; j++) program[program_length++] = (Instr){OP_MUL, deltas[j], offsets[j]};
+  program[program_length++] = (Instr){OP_CLEAR, 0, 0};
+  move_peak = 0;
+  return 1;
+}
+
+void out_flush() {
+  if (out_length) fwrite(out_buffer, 1, out_length, out_file);
+  fflush(out_file);
+  out_length = 0;
+}
+
+/* Appends c to the output buffer n times */
+static inline void out_repeat(int c, int n) {
+  while (n > 0) {
+    int k = (int)sizeof(out_buffer) - out_length;
+    if (k > n) k = n;
+    memset(out_buffer + out_length, c, k);
+    out_length += k;
+    n -= k;
+    if (out_length == (int)sizeof(out_buffer) || (c == '\n' && out_interactive)) out_flush();
+  }
+}
+
+/* Next byte of in_fd, read ahead in blocks */
+int in_byte() {
+  if (in_pos == in_length) {
+    out_flush();
+    ssize_t n = read(in_fd, in_buffer, sizeof(in_buffer));
+    if (n <= 0) return EOF;
+    in_pos = 0;
+    in_length = n;
+  }
+  return (unsigned char)in_buffer[in_pos++];
+}
+
+/* Operations shared by the execution engines, see also cells.h */
+static inline void op_move(int arg, int peak) {
+  if (cell + peak > max_cell_used) max_cell_used = cell + peak;
+  cell += arg;
+}
+
+static double monotonic_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Variants of the switch engine */
+enum { RUN_PLAIN, RUN_COUNT, RUN_PROFILE };
+
+#ifdef HAVE_COMPUTED_GOTO
+typedef struct {
+  void *handler;
+  int arg;
+  int offset;
+} ThreadedInstr;
+#endif
+
+#ifdef HAVE_JIT
+/* Called from the generated code, with rdi = current cell and rsi = r13 */
+static void jit_sync(void *p, void *max) {
+  cell = ((uint8_t *)p - (uint8_t *)tape) / cell_size;
+  max_cell_used = ((uint8_t *)max - (uint8_t *)tape) / cell_size;
+}
+#endif
+
+/* The engines for every cell type, selected with --cell= and --overflow= */
+#define CELL int8_t
+#define CELL_BITS 8
+#define CELL_WRAP 0
+#define CELL_NAME s8
+#include "cells.h"
+
+#define CELL int16_t
+#define CELL_BITS 16
+#define CELL_WRAP 0
+#define CELL_NAME s16
+#include "cells.h"
+
+#define CELL int32_t
+#define CELL_BITS 32
+#define CELL_WRAP 0
+#define CELL_NAME s32
+#include "cells.h"
+
+#define CELL uint8_t
+#define CELL_BITS 8
+#define CELL_WRAP 1
+#define CELL_NAME u8
+#include "cells.h"
+
+#define CELL uint16_t
+#define CELL_BITS 16
+#define CELL_WRAP 1
+#define CELL_NAME u16
+#include "cells.h"
+
+#define CELL uint32_t
+#define CELL_BITS 32
+#define CELL_WRAP 1
+#define CELL_NAME u32
+#include "cells.h"
+
+/* Points cells at the engines for cell_bits and cell_wrap */
+void select_cells() {
+  static const CellEngine *engines[2][3] = {
+    {&cell_engine_s8, &cell_engine_s16, &cell_engine_s32},
+    {&cell_engine_u8, &cell_engine_u16, &cell_engine_u32}
+  };
+  cells = engines[cell_wrap][cell_bits == 8 ? 0 : cell_bits == 16 ? 1 : 2];
+  cell_size = cell_bits / 8;
+  // A whole number of pages, so that both ends of the tape touch a guard
+  tape_page = sysconf(_SC_PAGESIZE);
+  tape_size = (tape_size * cell_size + tape_page - 1) / tape_page * tape_page / cell_size;
+  tape_guard = (TAPE_REACH * cell_size + tape_page - 1) / tape_page * tape_page;
+}
+
+void RunProfiled() {
+  profile_counts = calloc(program_length, sizeof(*profile_counts));
+  profile_time = calloc(program_length, sizeof(*profile_time));
+  if (!profile_counts || !profile_time) {
+    fprintf(stderr, COLOR_RED "Error: Could not allocate memory.\n" COLOR_RESET);
+    exit(1);
+  }
+  profile_depth = 0;
+  double start = monotonic_seconds();
+  cells->run_profiled();
+  profile_enter = monotonic_seconds() - start;
+}
+
+/*
+  JIT engine (x86-64 only): program[] is translated straight into machine
+  code in an mmap'd buffer, which is then called like a function.
+  Register use inside the generated code:
+    rbx  pointer to the current cell
+    r12  start of the tape
+    r13  highest cell reached so far (max_cell_used)
+  Input, output and the debug commands call back into C.
+  Instructions with an offset address the cell as [rbx + disp32].
+ */
+#ifdef HAVE_JIT
+typedef struct {
+  uint8_t *code;
+  size_t length, capacity;
+} JitBuffer;
+
+static void emit(JitBuffer *b, const void *bytes, size_t n) {
+  memcpy(b->code + b->length, bytes, n);
+  b->length += n;
+}
+
+#define EMIT(b, ...) emit(b, (const uint8_t[]){__VA_ARGS__}, sizeof((const uint8_t[]){__VA_ARGS__}))
+
+static void emit32(JitBuffer *b, int32_t v) { emit(b, &v, 4); }
+static void emit64(JitBuffer *b, uint64_t v) { emit(b, &v, 8); }
+
+/* mov rax, <function>; call rax */
+static void emit_call(JitBuffer *b, void *function) {
+  EMIT(b, 0x48, 0xB8);
+  emit64(b, (uint64_t)(uintptr_t)function);
+  EMIT(b, 0xFF, 0xD0);
+}
+
+/* cmp reg, r13; cmova r13, reg  (reg is rbx or rax) */
+static void emit_track_max(JitBuffer *b, int rax) {
+  if (rax) EMIT(b, 0x4C, 0x39, 0xE8, 0x4C, 0x0F, 0x47, 0xE8);
+  else EMIT(b, 0x4C, 0x39, 0xEB, 0x4C, 0x0F, 0x47, 0xEB);
+}
+
+/* Patches the rel8 operand at position at to jump to the current position */
+static void patch_rel8(JitBuffer *b, size_t at) {
+  b->code[at] = (uint8_t)(b->length - at - 1);
+}
+
+static void jit_output(int c, int n) { out_repeat(c, n); }
+
+/* Operand size prefix and opcode of an operation on a cell: op8 for 8-bit cells, op otherwise */
+static void emit_cell_op(JitBuffer *b, uint8_t op8, uint8_t op) {
+  if (cell_bits == 16) EMIT(b, 0x66);
+  EMIT(b, cell_bits == 8 ? op8 : op);
+}
+
+/* Loads the cell at [rbx + disp32] into eax (reg 0), ecx (1) or edi (7), extended to 32 bits */
+static void emit_load(JitBuffer *b, int reg, int32_t disp) {
+  if (cell_bits == 32) EMIT(b, 0x8B);
+  else EMIT(b, 0x0F, (cell_wrap ? 0xB6 : 0xBE) | (cell_bits == 16));
+  EMIT(b, 0x83 | reg << 3);
+  emit32(b, disp);
+}
+
+/* Stores the low cell_bits of eax (reg 0) or ecx (1) to [rbx + disp32] */
+static void emit_store(JitBuffer *b, int reg, int32_t disp) {
+  emit_cell_op(b, 0x88, 0x89);
+  EMIT(b, 0x83 | reg << 3);
+  emit32(b, disp);
+}
+
+static void emit_callback(JitBuffer *b, void *function) {
+  EMIT(b, 0x48, 0x89, 0xDF);   /* mov rdi, rbx */
+  EMIT(b, 0x4C, 0x89, 0xEE);   /* mov rsi, r13 */
+  emit_call(b, function);
+}
+
+void RunJit() {
+  JitBuffer b = {NULL, 0, (size_t)program_length * 64 + 256};
+  size_t *addr = malloc((program_length + 1) * sizeof(size_t));
+  b.code = mmap(NULL, b.capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (!addr || b.code == MAP_FAILED) {
+    fprintf(stderr, COLOR_RED "Error: Could not allocate memory.\n" COLOR_RESET);
+    exit(1);
+  }
+
+  /* push rbx; push r12; push r13; mov rbx, rdi; mov r12, rsi; mov r13, rdx */
+  EMIT(&b, 0x53, 0x41, 0x54, 0x41, 0x55, 0x48, 0x89, 0xFB, 0x49, 0x89, 0xF4, 0x49, 0x89, 0xD5);
+
+  for (int i = 0; i < program_length; i++) {
+    Instr *in = &program[i];
+    int32_t disp = in->offset * (int)cell_size;
+    int arg;
+    size_t skip;
+    addr[i] = b.length;
+    switch (in->op) {
+    case OP_ADD:
+    case OP_SUB:
+      if (in->op == OP_SUB && !cell_wrap) {
+        emit_load(&b, 0, disp);                             /* movsx eax, [rbx + disp32] */
+        EMIT(&b, 0x85, 0xC0, 0x7E, 0x00);                   /* test eax, eax; jle */
+        skip = b.length - 1;
+        EMIT(&b, 0x31, 0xC9, 0x2D);                         /* xor ecx, ecx; sub eax, imm32 */
+        emit32(&b, in->arg);
+        EMIT(&b, 0x0F, 0x4C, 0xC1);                         /* cmovl eax, ecx */
+        emit_store(&b, 0, disp);                            /* mov [rbx + disp32], eax */
+        patch_rel8(&b, skip);
+        break;
       }
+      arg = in->op == OP_ADD ? in->arg : -in->arg;
+      emit_cell_op(&b, 0x80, 0x81);                         /* add [rbx + disp32], imm */
+      EMIT(&b, 0x83);
+      emit32(&b, disp);
+      emit(&b, &arg, cell_size);
       break;
-    case '.': putchar(tape[cell]); break;
-    case '[': if (!tape[cell]) source_ptr = loops[source_ptr]; break;
-    case ']': if (tape[cell]) source_ptr = loops[source_ptr]; break;
-    case '#':
-      printf(COLOR_YELLOW "\n\n# DEBUG INFO (%d):\n" COLOR_RESET, debug_counter++);
-      printf("cell #%d: %d\n", cell, tape[cell]);
+    case OP_MOVE:
+      if (in->offset > 0) {
+        EMIT(&b, 0x48, 0x8D, 0x83);                         /* lea rax, [rbx + disp32] */
+        emit32(&b, disp);
+        emit_track_max(&b, 1);
+      }
+      if (in->arg) {
+        EMIT(&b, 0x48, 0x81, 0xC3);                         /* add rbx, imm32 */
+        emit32(&b, in->arg * (int)cell_size);
+      }
       break;
-    case '@':
-      printf(COLOR_GREEN "\n\n@ DEBUG INFO (%d):\n" COLOR_RESET, memory_counter++);
-      for (int i = 0; i <= max_cell_used; i++) {
-        printf("#%d: %d  ", i, tape[i]);
-        if (i % 5 == 4) printf("\n");
+    case OP_OUT:
+      emit_load(&b, 7, disp);                               /* movsx edi, [rbx + disp32] */
+      EMIT(&b, 0xBE);                                       /* mov esi, imm32 */
+      emit32(&b, in->arg);
+      emit_call(&b, (void *)jit_output);
+      break;
+    case OP_IN:
+      EMIT(&b, 0x48, 0x8D, 0xBB);                           /* lea rdi, [rbx + disp32] */
+      emit32(&b, disp);
+      emit_call(&b, cells->jit_input);
+      break;
+    case OP_JZ:
+    case OP_JNZ:
+      /* cmp [rbx], 0; je / jne rel32, patched below */
+      emit_cell_op(&b, 0x80, 0x83);
+      EMIT(&b, 0x3B, 0x00, 0x0F, in->op == OP_JZ ? 0x84 : 0x85);
+      emit32(&b, 0);
+      break;
+    case OP_CLEAR:
+      arg = 0;
+      emit_cell_op(&b, 0xC6, 0xC7);                         /* mov [rbx], 0 */
+      EMIT(&b, 0x03);
+      emit(&b, &arg, cell_size);
+      break;
+    case OP_SCAN:
+      EMIT(&b, 0x48, 0x89, 0xDF, 0xBE);                     /* mov rdi, rbx; mov esi, imm32 */
+      emit32(&b, in->arg);
+      emit_call(&b, cells->jit_scan);
+      EMIT(&b, 0x48, 0x89, 0xC3);                           /* mov rbx, rax */
+      if (in->arg > 0) emit_track_max(&b, 0);
+      break;
+    case OP_MUL:
+      emit_load(&b, 0, 0);                                  /* movsx eax, [rbx] */
+      EMIT(&b, 0x85, 0xC0, cell_wrap ? 0x74 : 0x7E, 0x00);  /* test eax, eax; je / jle */
+      skip = b.length - 1;
+      if (in->arg > 0 || cell_wrap) {
+        EMIT(&b, 0x69, 0xC0);                               /* imul eax, eax, imm32 */
+        emit32(&b, in->arg);
+        emit_cell_op(&b, 0x00, 0x01);                       /* add [rbx + disp32], eax */
+        EMIT(&b, 0x83);
+        emit32(&b, disp);
+      } else {
+        size_t keep;
+        EMIT(&b, 0x48, 0x69, 0xC0);                         /* imul rax, rax, imm32 */
+        emit32(&b, -in->arg);
+        emit_load(&b, 1, disp);                             /* movsx ecx, [rbx + disp32] */
+        EMIT(&b, 0x85, 0xC9, 0x7E, 0x00);                   /* test ecx, ecx; jle */
+        keep = b.length - 1;
+        EMIT(&b, 0x31, 0xD2, 0x48, 0x29, 0xC1);             /* xor edx, edx; sub rcx, rax */
+        EMIT(&b, 0x48, 0x0F, 0x4C, 0xCA);                   /* cmovl rcx, rdx */
+        emit_store(&b, 1, disp);                            /* mov [rbx + disp32], ecx */
+        patch_rel8(&b, keep);
       }
-      printf("\n");
+      if (in->offset > 0) {
+        EMIT(&b, 0x48, 0x8D, 0x83);                         /* lea rax, [rbx + disp32] */
+        emit32(&b, disp);
+        emit_track_max(&b, 1);
+      }
+      patch_rel8(&b, skip);
       break;
+    case OP_DEBUG_CELL: emit_callback(&b, cells->jit_debug_cell); break;
+    case OP_DEBUG_TAPE: emit_callback(&b, cells->jit_debug_tape); break;
+    }
+  }
+  addr[program_length] = b.length;
+
+  emit_callback(&b, (void *)jit_sync);
+  EMIT(&b, 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3);             /* pop r13; pop r12; pop rbx; ret */
+
+  /* Both jumps of a loop land just after the other end of the loop */
+  size_t jump = cell_bits == 16 ? 6 : 5;
+  for (int i = 0; i < program_length; i++) {
+    if (program[i].op == OP_JZ || program[i].op == OP_JNZ) {
+      int32_t rel = (int32_t)(addr[program[i].arg + 1] - (addr[i] + jump + 4));
+      memcpy(b.code + addr[i] + jump, &rel, sizeof(rel));
     }
   }
-  printf("\n");
+  free(addr);
+
+  if (mprotect(b.code, b.capacity, PROT_READ | PROT_EXEC) != 0) {
+    perror("mprotect");
+    exit(1);
+  }
+  uint8_t *base = tape;
+  ((void (*)(uint8_t *, uint8_t *, uint8_t *))b.code)(base + cell * cell_size, base, base + max_cell_used * cell_size);
+  munmap(b.code, b.capacity);
 }
+#endif
 
-void bf_to_c(const char *input_filename, const char *output_filename) {
-  FILE *in = fopen(input_filename, "r");
-  if (!in) {
-    fprintf(stderr, COLOR_RED "Error: Could not open file %s\n" COLOR_RESET, input_filename);
+void ExecuteSource() {
+  init_tape();
+  if (!CompileSource()) return;
+  RunProgram();
+  if (count_instructions) fprintf(stderr, "%llu instructions executed\n", executed_instructions);
+  if (profile) print_profile();
+}
+
+/* Runs the compiled program on the current tape, in_fd and out_file */
+void RunProgram() {
+  if (profile) RunProfiled();
+  else if (count_instructions) cells->run_counted();
+  else
+#ifdef HAVE_JIT
+  if (engine == ENGINE_JIT) RunJit();
+  else
+#endif
+  if (engine == ENGINE_THREADED || engine == ENGINE_JIT) cells->run_threaded();
+  else cells->run_switch();
+  out_repeat('\n', 1);
+  out_flush();
+}
+
+/*
+  --batch: compiles the program once and runs it on every input file,
+  writing the output of <input> to <input>.out. The runs are spread over
+  --jobs worker threads (one per core by default), each with its own
+  tape. A run that fails is reported and the others go on; the exit
+  status is 1 if any of them failed.
+ */
+static int batch_run(const char *input) {
+  size_t length = strlen(input);
+  char *output = malloc(length + 5);
+  if (!output) {
+    fprintf(stderr, COLOR_RED "Error: Could not allocate memory.\n" COLOR_RESET);
     exit(1);
   }
+  memcpy(output, input, length);
+  memcpy(output + length, ".out", 5);
+
+  in_fd = open(input, O_RDONLY);
+  if (in_fd < 0) {
+    fprintf(stderr, COLOR_RED "Error: Could not open file %s\n" COLOR_RESET, input);
+    free(output);
+    return 0;
+  }
+  out_file = fopen(output, "w");
+  if (!out_file) {
+    fprintf(stderr, COLOR_RED "Error: Could not open output file %s.\n" COLOR_RESET, output);
+    close(in_fd);
+    free(output);
+    return 0;
+  }
+
+  int ok = 1;
+  sigjmp_buf abort;
+  init_tape();
+  cell = max_cell_used = 0;
+  out_length = in_pos = in_length = 0;
+  debug_counter = memory_counter = 1;
+  if (sigsetjmp(abort, 1) == 0) {
+    run_abort = &abort;
+    RunProgram();
+  } else {
+    fprintf(stderr, COLOR_RED "Error: %s: pointer moved outside the tape (see --tape=)\n" COLOR_RESET, input);
+    out_flush();
+    // The JIT keeps its high-water mark in a register, lost here: clear the whole tape
+    max_cell_used = tape_size - 1;
+    ok = 0;
+  }
+  run_abort = NULL;
+  reset_tape();
+
+  if (fclose(out_file) != 0) {
+    fprintf(stderr, COLOR_RED "Error: Could not write output file %s.\n" COLOR_RESET, output);
+    ok = 0;
+  }
+  out_file = NULL;
+  close(in_fd);
+  free(output);
+  return ok;
+}
+
+static void *batch_worker(void *unused) {
+  (void)unused;
+  int i;
+  while ((i = atomic_fetch_add(&batch_next, 1)) < batch_count) {
+    if (!batch_run(batch_inputs[i])) atomic_fetch_add(&batch_failed, 1);
+  }
+  return NULL;
+}
+
+int run_batch(const char *filename, int count, char **inputs) {
+  if (count_instructions || profile) {
+    fprintf(stderr, COLOR_RED "Error: --count and --profile can't be used with --batch.\n" COLOR_RESET);
+    return 1;
+  }
+  load_file(filename);
+  if (!CompileSource()) return 1;
+
+  batch_inputs = inputs;
+  batch_count = count;
+  int jobs = batch_jobs ? batch_jobs : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (jobs > count) jobs = count;
+  if (jobs < 1) jobs = 1;
+  pthread_t *workers = malloc(jobs * sizeof(pthread_t));
+  if (!workers) {
+    fprintf(stderr, COLOR_RED "Error: Could not allocate memory.\n" COLOR_RESET);
+    exit(1);
+  }
+  for (int i = 0; i < jobs; i++) {
+    if (pthread_create(&workers[i], NULL, batch_worker, NULL) != 0) {
+      perror("pthread_create");
+      exit(1);
+    }
+  }
+  for (int i = 0; i < jobs; i++) pthread_join(workers[i], NULL);
+  free(workers);
+  return batch_failed ? 1 : 0;
+}
+
+/*
+  --profile report. Instructions and loops are listed hottest first with
+  the bytes of the source they came from, so a loop the optimizer did not
+  turn into an idiom and the code that dominates a run are easy to find.
+ */
+#define PROFILE_TOP 20
+
+static const char *op_names[] = {
+  "add", "sub", "move", "out", "in", "loop", "end", "#", "@", "clear", "scan", "mul"
+};
+
+static unsigned long long *profile_key;
+
+static int compare_profile(const void *a, const void *b) {
+  unsigned long long x = profile_key[*(const int *)a], y = profile_key[*(const int *)b];
+  return x < y ? 1 : x > y ? -1 : *(const int *)a - *(const int *)b;
+}
+
+/* The commands in a span, cut short after 40 */
+static void print_span(FILE *out, SourceSpan span) {
+  int printed = 0;
+  fprintf(out, "%8zu-%-8zu ", span.begin, span.end);
+  for (size_t i = span.begin; i < span.end; i++) {
+    if (!strchr("+-<>[].,#@", source[i]) || !source[i]) continue;
+    if (printed++ == 40) {
+      fprintf(out, "...");
+      break;
+    }
+    fputc(source[i], out);
+  }
+  fputc('\n', out);
+}
+
+void print_profile() {
+  FILE *out = stderr;
+  if (profile_filename && !(out = fopen(profile_filename, "w"))) {
+    fprintf(stderr, COLOR_RED "Error: Could not open profile file %s.\n" COLOR_RESET, profile_filename);
+    exit(1);
+  }
+
+  /* total[i] = instructions executed before instruction i */
+  unsigned long long *total = malloc((program_length + 1) * sizeof(*total));
+  int *order = malloc((program_length + 1) * sizeof(*order));
+  int *depth = malloc((program_length + 1) * sizeof(*depth));
+  if (!total || !order || !depth) {
+    fprintf(stderr, COLOR_RED "Error: Could not allocate memory.\n" COLOR_RESET);
+    exit(1);
+  }
+  total[0] = 0;
+  for (int i = 0, d = 0; i < program_length; i++) {
+    total[i + 1] = total[i] + profile_counts[i];
+    if (program[i].op == OP_JNZ) d--;
+    depth[i] = d;
+    if (program[i].op == OP_JZ) d++;
+  }
+  double all = total[program_length] ? total[program_length] : 1;
+
+  fprintf(out, "\nProfile: %llu instructions executed in %.3f s\n", total[program_length], profile_enter);
+
+  int n = 0;
+  for (int i = 0; i < program_length; i++) order[n++] = i;
+  profile_key = profile_counts;
+  qsort(order, n, sizeof(*order), compare_profile);
+  fprintf(out, "\nHottest instructions:\n");
+  fprintf(out, "  %6s %-6s %14s %6s %17s source\n", "index", "op", "count", "share", "bytes");
+  for (int k = 0; k < n && k < PROFILE_TOP && profile_counts[order[k]]; k++) {
+    int i = order[k];
+    fprintf(out, "  %6d %-6s %14llu %5.1f%% ", i, op_names[program[i].op], profile_counts[i], 100 * profile_counts[i] / all);
+    print_span(out, spans[i]);
+  }
+
+  /* A loop's key is everything executed from its '[' to its ']' */
+  unsigned long long *inside = calloc(program_length + 1, sizeof(*inside));
+  if (!inside) {
+    fprintf(stderr, COLOR_RED "Error: Could not allocate memory.\n" COLOR_RESET);
+    exit(1);
+  }
+  n = 0;
+  for (int i = 0; i < program_length; i++) {
+    if (program[i].op != OP_JZ) continue;
+    inside[i] = total[program[i].arg + 1] - total[i];
+    order[n++] = i;
+  }
+  profile_key = inside;
+  qsort(order, n, sizeof(*order), compare_profile);
+  fprintf(out, "\nHottest loops:\n");
+  fprintf(out, "  %5s %12s %14s %14s %6s %9s %17s source\n", "depth", "entries", "iterations", "instructions", "share", "time", "bytes");
+  for (int k = 0; k < n && k < PROFILE_TOP && inside[order[k]]; k++) {
+    int i = order[k], end = program[i].arg;
+    fprintf(out, "  %5d %12llu %14llu %14llu %5.1f%% ", depth[i], profile_counts[i], profile_counts[end], inside[i], 100 * inside[i] / all);
+    if (depth[i] == 0) fprintf(out, "%8.3fs ", profile_time[i]);
+    else fprintf(out, "%9s ", "-");
+    print_span(out, spans[i]);
+  }
+  fprintf(out, "\n");
+
+  if (out != stderr) fclose(out);
+  free(inside);
+  free(total);
+  free(order);
+  free(depth);
+  free(profile_counts);
+  free(profile_time);
+  profile_counts = NULL;
+  profile_time = NULL;
+}
+
+static void c_indent(FILE *out, int depth) {
+  for (int i = 0; i < depth; i++) fputc('\t', out);
+}
+
+/*
+  Translates a Brainfuck file to C through the same IR as the interpreter,
+  so folded runs, deferred pointer moves and loop idioms carry over.
+  The generated code uses the interpreter's cells (--cell= and
+  --overflow=), with ',' leaving the cell unchanged on EOF.
+ */
+void bf_to_c(const char *input_filename, const char *output_filename) {
+  load_file(input_filename);
+  if (!CompileSource()) exit(1);
 
   FILE *out = fopen(output_filename, "w");
   if (!out) {
@@ -181,51 +1182,160 @@ void bf_to_c(const char *input_filename, const char *output_filename) {
     exit(1);
   }
 
-  int c;
-  int cellsize = TAPESIZE;
+  size_t cellsize = tape_size;
 
   fprintf(out,
           "#include <stdio.h>\n"
-          "#include <stdlib.h>\n\n"
+          "#include <stdlib.h>\n"
+          "#include <stdint.h>\n"
+          "#include <unistd.h>\n\n"
+          "typedef %sint%d_t cell_t;\n\n"
+          "%s\n\n", cell_wrap ? "u" : "", cell_bits,
+          cell_wrap ? "#define SUB(x, n) (x) -= (n)" : "#define SUB(x, n) if ((x) > 0) (x) = (x) > (n) ? (x) - (n) : 0");
+  fprintf(out,
+          "static char out_buffer[65536], in_buffer[65536];\n"
+          "static int out_length, out_tty, in_pos, in_length;\n\n"
+          "static void out_flush(void)\n{\n"
+          "\tfwrite(out_buffer, 1, out_length, stdout);\n"
+          "\tfflush(stdout);\n"
+          "\tout_length = 0;\n"
+          "}\n\n"
+          "static void out(int c, int n)\n{\n"
+          "\twhile (n-- > 0) {\n"
+          "\t\tout_buffer[out_length++] = c;\n"
+          "\t\tif (out_length == sizeof(out_buffer) || (out_tty && c == '\\n'))\n"
+          "\t\t\tout_flush();\n"
+          "\t}\n"
+          "}\n\n"
+          "static int in(void)\n{\n"
+          "\tif (in_pos == in_length) {\n"
+          "\t\tout_flush();\n"
+          "\t\tssize_t n = read(0, in_buffer, sizeof(in_buffer));\n"
+          "\t\tif (n <= 0)\n"
+          "\t\t\treturn EOF;\n"
+          "\t\tin_pos = 0;\n"
+          "\t\tin_length = n;\n"
+          "\t}\n"
+          "\treturn (unsigned char)in_buffer[in_pos++];\n"
+          "}\n\n"
           "int main(int argc, char **argv)\n{\n"
-          "\tunsigned char *cell = calloc(%d, 1);\n"
-          "\tunsigned char *cells = cell;\n"
+          "\tcell_t *cell = calloc(%zu, sizeof(cell_t));\n"
+          "\tcell_t *cells = cell;\n"
           "\tif (!cell) {\n"
           "\t\tfprintf(stderr, \"Error allocating memory.\\n\");\n"
           "\t\treturn 1;\n"
-          "\t}\n\n", cellsize
+          "\t}\n"
+          "\tout_tty = isatty(1);\n\n", cellsize
           );
-  while ((c = getc(in)) != EOF) {
-    switch (c) {
-    case '>': fprintf(out, "\t\t++cell;\n"); break;
-    case '<': fprintf(out, "\t\t--cell;\n"); break;
-    case '+': fprintf(out, "\t\t++*cell;\n"); break;
-    case '-': fprintf(out, "\t\t--*cell;\n"); break;
-    case '.': fprintf(out, "\t\tputchar(*cell);\n"); break;
-    case ',': fprintf(out, "\t\t*cell = getchar();\n"); break;
-    case '[': fprintf(out, "\twhile (*cell) {\n"); break;
-    case ']': fprintf(out, "\t}\n"); break;
-    default: break;
+  int depth = 1;
+  for (int i = 0; i < program_length; i++) {
+    Instr *in = &program[i];
+    if (in->op == OP_JNZ) depth--;
+    if (in->op == OP_DEBUG_CELL || in->op == OP_DEBUG_TAPE || (in->op == OP_MOVE && !in->arg)) continue;
+    c_indent(out, depth);
+    switch (in->op) {
+    case OP_ADD: fprintf(out, "cell[%d] += %d;\n", in->offset, in->arg); break;
+    case OP_SUB: fprintf(out, "SUB(cell[%d], %d);\n", in->offset, in->arg); break;
+    case OP_MOVE: fprintf(out, "cell += %d;\n", in->arg); break;
+    case OP_OUT: fprintf(out, "out(cell[%d], %d);\n", in->offset, in->arg); break;
+    case OP_IN: fprintf(out, "{ int c = in(); if (c != EOF) cell[%d] = c; }\n", in->offset); break;
+    case OP_JZ: fprintf(out, "while (*cell) {\n"); depth++; break;
+    case OP_JNZ: fprintf(out, "}\n"); break;
+    case OP_CLEAR: fprintf(out, "*cell = 0;\n"); break;
+    case OP_SCAN: fprintf(out, "while (*cell) cell += %d;\n", in->arg); break;
+    case OP_MUL:
+      if (cell_wrap) fprintf(out, "cell[%d] += *cell * %d;\n", in->offset, in->arg);
+      else if (in->arg > 0) fprintf(out, "if (*cell > 0) cell[%d] += *cell * %d;\n", in->offset, in->arg);
+      else fprintf(out, "if (*cell > 0) SUB(cell[%d], *cell * %d);\n", in->offset, -in->arg);
+      break;
     }
   }
-	
-  fprintf(out, "\n\tfree(cells);\n\treturn 0;\n}\n\n");
-  fclose(in);
+
+  fprintf(out, "\n\tout_flush();\n\tfree(cells);\n\treturn 0;\n}\n\n");
   fclose(out);
   printf("Brainfuck code converted to C code in %s\n", output_filename);
 }
 
+/*
+  Compiles the generated C with gcc at the optimization level chosen
+  with -O (default -O2).
+ */
 void compile_c_to_executable(const char *c_filename, const char *executable_filename) {
   char command[256];
-  snprintf(command, sizeof(command), "gcc %s -o %s", c_filename, executable_filename);
+  snprintf(command, sizeof(command), "gcc %s %s -o %s", c_optimization, c_filename, executable_filename);
   int result = system(command);
-  if (result == -1) {
+  if (result != 0) {
     fprintf(stderr, "Error: Compilation failed.\n");
   } else {
     printf("Executable created: %s\n", executable_filename);
   }
 }
 
+/* Grows source_buffer so that it holds at least length bytes */
+void source_reserve(size_t length) {
+  if (length <= source_capacity) return;
+  size_t capacity = source_capacity ? source_capacity : 4096;
+  while (capacity < length) capacity *= 2;
+  source_buffer = realloc(source_buffer, capacity);
+  if (!source_buffer) {
+    fprintf(stderr, COLOR_RED "Error: Could not allocate memory.\n" COLOR_RESET);
+    exit(1);
+  }
+  source_capacity = capacity;
+}
+
+/* Maps the tape on first use, see the comment on the globals */
+void init_tape() {
+  if (tape) return;
+  size_t bytes = tape_size * cell_size;
+  uint8_t *base = mmap(NULL, bytes + 2 * tape_guard, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (base == MAP_FAILED || mprotect(base + tape_guard, bytes, PROT_READ | PROT_WRITE) != 0) {
+    perror("mmap");
+    exit(1);
+  }
+  tape = base + tape_guard;
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = handle_sigsegv;
+  sa.sa_flags = SA_SIGINFO;
+  sigaction(SIGSEGV, &sa, NULL);
+}
+
+/*
+  Zeroes the cells up to max_cell_used, the only ones a program can have
+  written. Large ranges are handed back to the kernel instead, which maps
+  zero pages again on the next touch.
+ */
+void reset_tape() {
+  size_t bytes = (size_t)(max_cell_used + 1) * cell_size;
+  if (bytes > tape_size * cell_size) bytes = tape_size * cell_size;
+  if (bytes < (1 << 20)) {
+    memset(tape, 0, bytes);
+  } else {
+    bytes = (bytes + tape_page - 1) / tape_page * tape_page;
+    madvise(tape, bytes, MADV_DONTNEED);
+  }
+}
+
+void handle_sigsegv(int sig, siginfo_t *info, void *context) {
+  (void)context;
+  uint8_t *addr = info->si_addr;
+  uint8_t *start = (uint8_t *)tape - tape_guard;
+  uint8_t *end = (uint8_t *)tape + tape_size * cell_size + tape_guard;
+  if (addr >= start && addr < end) {
+    if (run_abort) siglongjmp(*run_abort, 1);
+    // What the program printed so far is still in out_buffer, and write is async-signal-safe
+    for (int done = 0, n; done < out_length; done += n)
+      if ((n = write(STDOUT_FILENO, out_buffer + done, out_length - done)) <= 0) break;
+    const char message[] = COLOR_RED "\nError: pointer moved outside the tape (see --tape=)\n" COLOR_RESET;
+    if (write(STDERR_FILENO, message, sizeof(message) - 1) < 0) _exit(1);
+    _exit(1);
+  }
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
 void handle_sigint(int sig) {
   (void)sig; 
   printf("\nProcess Terminated\n");
@@ -239,8 +1349,20 @@ void print_help() {
   printf("  bf                      Run the interpreter interactively.\n");
   printf("  bf -h                   Display this help message.\n");
   printf("  bf -f <filename>        Execute Brainfuck code from a file.\n");
+  printf("  bf -j [filename]        Execute Brainfuck code with the JIT (interactively if no file).\n");
+  printf("  bf --batch <file> <inputs...>\n");
+  printf("                          Run a file on every input, writing <input>.out.\n");
   printf("  bf -t <filename>        Convert Brainfuck code to C code.\n");
   printf("  bf -c <input> <output>  Compile Brainfuck code to an executable.\n");
+  printf("\nOptions:\n");
+  printf("  --count                 Count the instructions executed (switch engine).\n");
+  printf("  --profile[=<file>]      Report the hottest instructions and loops (switch engine).\n");
+  printf("  --cell=<bits>           Cell width: 8, 16 (default) or 32 bits.\n");
+  printf("  --overflow=<mode>       '-' below 0: saturate (default, stays 0) or wrap.\n");
+  printf("  --jobs=<n>              Worker threads used by --batch (default: one per core).\n");
+  printf("  --tape=<cells>          Number of cells on the tape, rounded up to a whole page (default %d).\n", TAPESIZE);
+  printf("  -O<level>               Optimization level passed to gcc by -c: 0-3, s, g or z (default -O2).\n");
+  printf("  --engine=<name>         Interpreter engine: switch (default), threaded or jit.\n");
   printf("\nCommands:\n");
   printf("  +                       Increment the current cell\n");
   printf("  -                       Decrement the current cell\n");
@@ -0,0 +1,237 @@
+/*
+  Engines for one kind of cell. bf.c includes this file once per cell
+  type, with
+    CELL       the C type of a cell
+    CELL_BITS  its width
+    CELL_WRAP  1 if cells wrap around, 0 if '-' saturates at 0
+    CELL_NAME  the suffix of the generated functions
+  so that every engine is compiled for a fixed cell type and none of them
+  branch on the cell semantics while running.
+ */
+#define CELL_FN(name) CELL_PASTE(name, CELL_NAME)
+#define CELL_PASTE(name, suffix) CELL_PASTE_(name, suffix)
+#define CELL_PASTE_(name, suffix) name##_##suffix
+
+#define T ((CELL *)tape)
+
+/*
+  Index of the nearest zero cell at or after (step 1) or at or before
+  (step -1) cell i. A 64-bit word holding 64 / CELL_BITS cells is tested
+  at a time with the usual "has zero lane" trick.
+ */
+#define CELL_LANES (64 / CELL_BITS)
+#define CELL_ONES (~0ULL / ((1ULL << CELL_BITS) - 1))
+#define CELL_HAS_ZERO(v) (((v) - CELL_ONES) & ~(v) & (CELL_ONES << (CELL_BITS - 1)))
+
+static int CELL_FN(scan_right)(int i) {
+  uint64_t v;
+  while (i % CELL_LANES && T[i]) i++;
+  if (!T[i]) return i;
+  for (;; i += CELL_LANES) {
+    memcpy(&v, &T[i], sizeof(v));
+    if (CELL_HAS_ZERO(v)) break;
+  }
+  while (T[i]) i++;
+  return i;
+}
+
+static int CELL_FN(scan_left)(int i) {
+  uint64_t v;
+  while (i % CELL_LANES != CELL_LANES - 1 && T[i]) i--;
+  if (!T[i]) return i;
+  for (;; i -= CELL_LANES) {
+    memcpy(&v, &T[i - (CELL_LANES - 1)], sizeof(v));
+    if (CELL_HAS_ZERO(v)) break;
+  }
+  while (T[i]) i--;
+  return i;
+}
+
+static inline void CELL_FN(op_sub)(CELL *p, int n) {
+#if CELL_WRAP
+  *p -= n;
+#else
+  if (*p > 0) *p = *p > n ? *p - n : 0;
+#endif
+}
+
+static inline void CELL_FN(op_input)(CELL *p) {
+  user_input = in_byte();
+  if (user_input == EOF) {
+    //DO NOTHING
+  } else {
+    *p = user_input;
+    if (*p == '\n') {
+      *p = 10;
+    }
+  }
+}
+
+static inline void CELL_FN(op_scan)(int step) {
+  if (step == 1) cell = CELL_FN(scan_right)(cell);
+  else if (step == -1) cell = CELL_FN(scan_left)(cell);
+  else while (T[cell]) cell += step;
+  if (cell > max_cell_used) max_cell_used = cell;
+}
+
+static inline void CELL_FN(op_mul)(int factor, int offset) {
+  int target = cell + offset;
+#if CELL_WRAP
+  if (T[cell]) {
+    T[target] += (CELL)((unsigned long long)T[cell] * factor);
+#else
+  if (T[cell] > 0) {
+    if (factor > 0) {
+      T[target] += T[cell] * factor;
+    } else if (T[target] > 0) {
+      long long amount = (long long)T[cell] * -factor;
+      T[target] = T[target] > amount ? T[target] - amount : 0;
+    }
+#endif
+    if (target > max_cell_used) max_cell_used = target;
+  }
+}
+
+static void CELL_FN(op_debug_cell)() {
+  out_flush();
+  fprintf(out_file, COLOR_YELLOW "\n\n# DEBUG INFO (%d):\n" COLOR_RESET, debug_counter++);
+  fprintf(out_file, "cell #%d: %lld\n", cell, (long long)T[cell]);
+  fflush(out_file);
+}
+
+static void CELL_FN(op_debug_tape)() {
+  out_flush();
+  fprintf(out_file, COLOR_GREEN "\n\n@ DEBUG INFO (%d):\n" COLOR_RESET, memory_counter++);
+  for (int i = 0; i <= max_cell_used; i++) {
+    fprintf(out_file, "#%d: %lld  ", i, (long long)T[i]);
+    if (i % 5 == 4) fputc('\n', out_file);
+  }
+  fputc('\n', out_file);
+  fflush(out_file);
+}
+
+/*
+  Switch engine: one indirect branch for every instruction.
+  RUN_COUNT also counts executed instructions for --count and
+  RUN_PROFILE counts them per instruction and times top-level loops for
+  --profile; all variants are generated from this one body.
+ */
+static inline void CELL_FN(run_switch)(const int mode) {
+  CELL *t = tape;
+  for (int pc = 0; pc < program_length; pc++) {
+    Instr *in = &program[pc];
+    if (mode == RUN_COUNT) executed_instructions++;
+    if (mode == RUN_PROFILE) profile_counts[pc]++;
+    switch (in->op) {
+    case OP_ADD: t[cell + in->offset] += in->arg; break;
+    case OP_SUB: CELL_FN(op_sub)(&t[cell + in->offset], in->arg); break;
+    case OP_MOVE: op_move(in->arg, in->offset); break;
+    case OP_IN: CELL_FN(op_input)(&t[cell + in->offset]); break;
+    case OP_OUT: out_repeat(t[cell + in->offset], in->arg); break;
+    case OP_JZ:
+      if (!t[cell]) pc = in->arg;
+      else if (mode == RUN_PROFILE && profile_depth++ == 0) profile_enter = monotonic_seconds();
+      break;
+    case OP_JNZ:
+      if (t[cell]) pc = in->arg;
+      else if (mode == RUN_PROFILE && --profile_depth == 0) profile_time[in->arg] += monotonic_seconds() - profile_enter;
+      break;
+    case OP_CLEAR: t[cell] = 0; break;
+    case OP_SCAN: CELL_FN(op_scan)(in->arg); break;
+    case OP_MUL: CELL_FN(op_mul)(in->arg, in->offset); break;
+    case OP_DEBUG_CELL: CELL_FN(op_debug_cell)(); break;
+    case OP_DEBUG_TAPE: CELL_FN(op_debug_tape)(); break;
+    }
+  }
+}
+
+static void CELL_FN(RunSwitch)() { CELL_FN(run_switch)(RUN_PLAIN); }
+static void CELL_FN(RunCounted)() { CELL_FN(run_switch)(RUN_COUNT); }
+static void CELL_FN(RunProfiled)() { CELL_FN(run_switch)(RUN_PROFILE); }
+
+/*
+  Threaded engine: program[] is decoded once into a stream carrying the
+  address of the handler of each instruction, and every handler jumps
+  straight to the next one (labels as values, GCC / Clang only).
+  This gives each instruction its own indirect branch for the predictor.
+ */
+#ifdef HAVE_COMPUTED_GOTO
+static void CELL_FN(RunThreaded)() {
+  static void *handlers[] = {
+    [OP_ADD] = &&op_add, [OP_SUB] = &&op_sub, [OP_MOVE] = &&op_move,
+    [OP_OUT] = &&op_out, [OP_IN] = &&op_in, [OP_JZ] = &&op_jz, [OP_JNZ] = &&op_jnz,
+    [OP_DEBUG_CELL] = &&op_debug_cell, [OP_DEBUG_TAPE] = &&op_debug_tape,
+    [OP_CLEAR] = &&op_clear, [OP_SCAN] = &&op_scan, [OP_MUL] = &&op_mul
+  };
+
+  ThreadedInstr *code = malloc((program_length + 1) * sizeof(ThreadedInstr));
+  if (!code) {
+    fprintf(stderr, COLOR_RED "Error: Could not allocate memory.\n" COLOR_RESET);
+    exit(1);
+  }
+  for (int i = 0; i < program_length; i++) {
+    code[i] = (ThreadedInstr){handlers[program[i].op], program[i].arg, program[i].offset};
+  }
+  code[program_length] = (ThreadedInstr){&&op_end, 0, 0};
+
+  CELL *t = tape;
+  ThreadedInstr *ip = code;
+#define NEXT() goto *(++ip)->handler
+  goto *ip->handler;
+
+ op_add: t[cell + ip->offset] += ip->arg; NEXT();
+ op_sub: CELL_FN(op_sub)(&t[cell + ip->offset], ip->arg); NEXT();
+ op_move: op_move(ip->arg, ip->offset); NEXT();
+ op_in: CELL_FN(op_input)(&t[cell + ip->offset]); NEXT();
+ op_out: out_repeat(t[cell + ip->offset], ip->arg); NEXT();
+ op_jz: if (!t[cell]) ip = code + ip->arg; NEXT();
+ op_jnz: if (t[cell]) ip = code + ip->arg; NEXT();
+ op_clear: t[cell] = 0; NEXT();
+ op_scan: CELL_FN(op_scan)(ip->arg); NEXT();
+ op_mul: CELL_FN(op_mul)(ip->arg, ip->offset); NEXT();
+ op_debug_cell: CELL_FN(op_debug_cell)(); NEXT();
+ op_debug_tape: CELL_FN(op_debug_tape)(); NEXT();
+#undef NEXT
+
+ op_end:
+  free(code);
+}
+#endif
+
+/* Callbacks of the JIT, see RunJit */
+#ifdef HAVE_JIT
+static void CELL_FN(jit_input)(void *p) { CELL_FN(op_input)(p); }
+static void CELL_FN(jit_debug_cell)(void *p, void *max) { jit_sync(p, max); CELL_FN(op_debug_cell)(); }
+static void CELL_FN(jit_debug_tape)(void *p, void *max) { jit_sync(p, max); CELL_FN(op_debug_tape)(); }
+
+static void *CELL_FN(jit_scan)(void *p, int step) {
+  CELL *c = p;
+  cell = c - T;
+  if (step == 1) return &T[CELL_FN(scan_right)(cell)];
+  if (step == -1) return &T[CELL_FN(scan_left)(cell)];
+  while (*c) c += step;
+  return c;
+}
+#endif
+
+const CellEngine CELL_FN(cell_engine) = {
+  CELL_FN(RunSwitch), CELL_FN(RunCounted), CELL_FN(RunProfiled),
+#ifdef HAVE_COMPUTED_GOTO
+  CELL_FN(RunThreaded),
+#else
+  CELL_FN(RunSwitch),
+#endif
+#ifdef HAVE_JIT
+  (void *)CELL_FN(jit_input), (void *)CELL_FN(jit_scan),
+  (void *)CELL_FN(jit_debug_cell), (void *)CELL_FN(jit_debug_tape)
+#endif
+};
+
+#undef T
+#undef CELL_LANES
+#undef CELL_ONES
+#undef CELL_HAS_ZERO
+#undef CELL
+#undef CELL_BITS
+#undef CELL_WRAP
+#undef CELL_NAME
@@ -7,10 +7,19 @@
  * Author: Mitchell <mitchell@sdf.org>
  * Date: August 2024
  * 
- * Compilation: gcc -o passgen passgen.c -lcrypto
- * Usage: passgen <length>
+ * Compilation: gcc -O2 -o passgen passgen.c -lcrypto -lpthread -lm
+ * Usage: passgen [-n <count>] [--alnum|--hex|--base64url|--charset=<chars>]
+ *                [--require=lower,upper,digit,symbol] <length>
  * 
  * <length> - The length of the generated password.
+ * -n <count> - Generate count passwords at once, one per line.
+ * --alnum, --hex, --base64url, --charset=<chars> - Draw the characters from
+ *     another alphabet than the default letters, digits and symbols.
+ * --require=<classes> - Every password has at least one character of each class.
+ * --stream - Write an endless stream of characters (or <length> of them) in
+ *     blocks, at constant memory; see passgen.h for the same in-process.
+ * --bench - Time rule30, complex_mix and the character sampling on their own.
+ * --quality [<length>] - Check the characters of many passwords for bias.
  * 
  * This program generates a secure password of the specified length using a
  * combination of Rule 30 cellular automaton and cryptographic random bytes.
@@ -23,9 +32,38 @@
 #include <stdint.h>
 #include <string.h>
 #include <ctype.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <math.h>
+#include <time.h>
 #include <openssl/rand.h>
+#include "passgen.h"
  
 #define CHARSET "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789!@#$%^&*()_+"
+#define ALNUM "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789"
+#define HEX "0123456789abcdef"
+#define BASE64URL "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_"
+
+// Character classes of --require=
+enum { CLASS_LOWER = 1, CLASS_UPPER = 2, CLASS_DIGIT = 4, CLASS_SYMBOL = 8 };
+
+// The alphabet of the command line, see Alphabet in passgen.h
+Alphabet alphabet;
+
+// Batches of at least BATCH_THREAD_BYTES bytes are split over up to BATCH_THREADS threads
+#define BATCH_THREAD_BYTES (1 << 20)
+#define BATCH_THREADS 16
+// Largest single RAND_bytes draw
+#define RAND_CHUNK (1 << 30)
+
+// Heap allocations, counted for --bench
+static atomic_long allocations;
+
+static void *allocate(size_t count, size_t size) {
+  allocations++;
+  return calloc(count, size);
+}
 
 int is_valid_integer(const char* str) {
   if (*str == '\0') return 0;
@@ -36,64 +74,608 @@ int is_valid_integer(const char* str) {
   return 1;
 }
 
-void rule30(uint8_t *buffer, int length) {
-  uint8_t *state = (uint8_t*)malloc(length * sizeof(uint8_t));
-  memset(state, 0, length * sizeof(uint8_t));
-  state[length / 2] = 1;
-
-  for (int i = 0; i < length; i++) {
-    buffer[i] = state[i];
-    uint8_t *next_state = (uint8_t*)malloc(length * sizeof(uint8_t));
-    memset(next_state, 0, length * sizeof(uint8_t));
-
-    for (int j = 0; j < length; j++) {
-      uint8_t left = (j == 0) ? 0 : state[j - 1];
-      uint8_t center = state[j];
-      uint8_t right = (j == length - 1) ? 0 : state[j + 1];
-      next_state[j] = !(left ^ (center || right));
-    }
+/*
+  Rule 30 (complemented) on PASSGEN_CELLS cells, fixed at 0 past both
+  ends and packed 64 to a word in one u64x4: the neighbours of a word come
+  from lane shuffles, so a generation is a handful of vector operations
+  with no branches. Steps length generations from generation, writing
+  cell (generation % PASSGEN_CELLS) of each to buffer, and leaves the
+  state of the next one in cells. The width is fixed, so the cost is
+  linear in length.
+ */
+typedef uint64_t u64x4 __attribute__((vector_size(32)));
 
-    memcpy(state, next_state, length * sizeof(uint8_t));
-    free(next_state);
+static void rule30_run(uint64_t cells[PASSGEN_WORDS], unsigned long generation, uint8_t *buffer, int length) {
+  _Static_assert(PASSGEN_WORDS == 4, "the automaton is one u64x4");
+  u64x4 state, zero = {0}, before = {4, 0, 1, 2}, after = {1, 2, 3, 4};
+  memcpy(&state, cells, sizeof(state));
+  for (int i = 0; i < length; i++, generation++) {
+    unsigned cell = generation % PASSGEN_CELLS;
+    buffer[i] = state[cell / 64] >> cell % 64 & 1;
+    u64x4 left = state << 1 | __builtin_shuffle(state, zero, before) >> 63;
+    u64x4 right = state >> 1 | __builtin_shuffle(state, zero, after) << 63;
+    state = ~(left ^ (state | right));
   }
+  memcpy(cells, &state, sizeof(state));
+}
 
-  free(state);
+// The first length cells of the automaton, from a single cell in the middle
+void rule30(uint8_t *buffer, int length) {
+  uint64_t cells[PASSGEN_WORDS] = {0};
+  cells[PASSGEN_WORDS / 2] = 1;
+  rule30_run(cells, 0, buffer, length);
 }
 
 void complex_mix(uint8_t *buffer1, uint8_t *buffer2, uint8_t *result, int length) {
-  for (int i = 0; i < length; ++i) {
+  // The neighbours only wrap around in the last two bytes, so the rest needs no %
+  int i = 0;
+  for (; i < length - 2; ++i) {
+    uint8_t mixed = (buffer1[i] ^ buffer2[i]) + (buffer1[i + 1] * buffer2[i + 2]);
+    result[i] = (mixed << 3) | (mixed >> 5);
+  }
+  for (; i < length; ++i) {
     result[i] = (buffer1[i] ^ buffer2[i]) + (buffer1[(i + 1) % length] * buffer2[(i + 2) % length]);
     result[i] = (result[i] << 3) | (result[i] >> 5);
   }
 }
 
+static int char_class(char c) {
+  if (islower((unsigned char)c)) return CLASS_LOWER;
+  if (isupper((unsigned char)c)) return CLASS_UPPER;
+  if (isdigit((unsigned char)c)) return CLASS_DIGIT;
+  return CLASS_SYMBOL;
+}
+
+/*
+  Builds an alphabet from chars, without repeats. Returns 0, or -1 if it
+  has fewer than two characters or lacks one of the required classes.
+ */
+int set_alphabet(Alphabet *alphabet, const char *chars, int required) {
+  memset(alphabet, 0, sizeof(*alphabet));
+  int classes = 0;
+  for (; *chars; chars++) {
+    if (!memchr(alphabet->map, *chars, alphabet->size)) {
+      alphabet->map[alphabet->size++] = *chars;
+      classes |= char_class(*chars);
+    }
+  }
+  while (1 << alphabet->bits < alphabet->size) {
+    alphabet->bits++;
+  }
+  alphabet->required = required;
+  return alphabet->size < 2 || (classes & required) != required ? -1 : 0;
+}
+
+/*
+  The number of mixed bytes drawn for a password of length characters:
+  what rejection sampling takes on average, and an eighth more. A block
+  is drawn again in the rare case that this runs out.
+ */
+int block_length(int length) {
+  double expected = (double)length * alphabet.bits / 8 * (1 << alphabet.bits) / alphabet.size;
+  expected += expected / 8 + 16;
+  return expected < INT32_MAX ? (int)expected : INT32_MAX;
+}
+
+/*
+  Samples up to length characters from bytes of mixed data, a byte at a
+  time, used up bits at a time. Returns how many characters it wrote,
+  fewer than length if the data ran out.
+ */
+int sample_chars(const uint8_t *mixed, int bytes, char *out, int length) {
+  uint64_t bits = 0, mask = (1ULL << alphabet.bits) - 1;
+  int pos = 0, available = 0, i = 0;
+  while (i < length) {
+    if (available < alphabet.bits) {
+      if (pos == bytes) break;
+      bits |= (uint64_t)mixed[pos++] << available;
+      available += 8;
+      continue;
+    }
+    char c = alphabet.map[bits & mask];
+    bits >>= alphabet.bits;
+    available -= alphabet.bits;
+    if (c) {
+      out[i++] = c;
+    }
+  }
+  return i;
+}
+
+/*
+  Mixes the rule30 cells with a block of random bytes and samples a
+  password of length characters from the result. rand_buffer is refilled
+  when the block runs out, and the whole password drawn again if it
+  lacks a required class. Returns 0, or -1 if RAND_bytes fails.
+ */
+int combine_password(const uint8_t *rule30_buffer, uint8_t *rand_buffer, uint8_t *combined_buffer,
+                     char *password, int length) {
+  int block = block_length(length);
+  for (;;) {
+    complex_mix((uint8_t *)rule30_buffer, rand_buffer, combined_buffer, block);
+    int done = sample_chars(combined_buffer, block, password, length);
+    while (done < length) {
+      if (RAND_bytes(rand_buffer, block) != 1) return -1;
+      complex_mix((uint8_t *)rule30_buffer, rand_buffer, combined_buffer, block);
+      done += sample_chars(combined_buffer, block, password + done, length - done);
+    }
+
+    int classes = 0;
+    for (int i = 0; alphabet.required && i < length; i++) {
+      classes |= char_class(password[i]);
+    }
+    if ((classes & alphabet.required) == alphabet.required) {
+      return 0;
+    }
+    if (RAND_bytes(rand_buffer, block) != 1) return -1;
+  }
+}
+
 void generate_combined_password(char* password, int length) {
-  uint8_t *rule30_buffer = (uint8_t*)malloc(length * sizeof(uint8_t));
-  rule30(rule30_buffer, length);
+  int block = block_length(length);
+  uint8_t *rule30_buffer = allocate(block, sizeof(uint8_t));
+  uint8_t *rand_buffer = allocate(block, sizeof(uint8_t));
+  uint8_t *combined_buffer = allocate(block, sizeof(uint8_t));
+  if (rule30_buffer == NULL || rand_buffer == NULL || combined_buffer == NULL) {
+    perror("Failed to allocate memory for password");
+    exit(1);
+  }
+  rule30(rule30_buffer, block);
 
-  unsigned char rand_buffer[length];
-  if (RAND_bytes(rand_buffer, length) != 1) {
+  if (RAND_bytes(rand_buffer, block) != 1 ||
+      combine_password(rule30_buffer, rand_buffer, combined_buffer, password, length) != 0) {
     fprintf(stderr, "Failed to generate random bytes.\n");
     exit(1);
   }
+  password[length] = '\0';
 
-  uint8_t *combined_buffer = (uint8_t*)malloc(length * sizeof(uint8_t));
-  complex_mix(rule30_buffer, rand_buffer, combined_buffer, length);
+  memset(rand_buffer, 0, block);
+  free(rule30_buffer);
+  free(rand_buffer);
+  free(combined_buffer);
+}
 
-  int charset_size = strlen(CHARSET);
-  for (int i = 0; i < length; ++i) {
-    int combined_index = combined_buffer[i] % charset_size;
-    password[i] = CHARSET[combined_index];
+/*
+  A share of a batch: passwords first .. first + count - 1, written to
+  out one per line. The random bytes for all of them are drawn at once.
+ */
+typedef struct {
+  const uint8_t *rule30_buffer;
+  char *out;
+  long first, count;
+  int length;
+  int failed, started;
+  pthread_t thread;
+} Batch;
+
+static void *generate_batch(void *arg) {
+  Batch *batch = arg;
+  int block = block_length(batch->length);
+  size_t bytes = (size_t)batch->count * block;
+  uint8_t *rand_buffer = allocate(bytes, 1);
+  uint8_t *combined_buffer = allocate(block, 1);
+  if (rand_buffer == NULL || combined_buffer == NULL) {
+    batch->failed = 1;
+    free(rand_buffer);
+    free(combined_buffer);
+    return NULL;
+  }
+  for (size_t done = 0; done < bytes; done += RAND_CHUNK) {
+    int chunk = bytes - done < RAND_CHUNK ? (int)(bytes - done) : RAND_CHUNK;
+    if (RAND_bytes(rand_buffer + done, chunk) != 1) {
+      batch->failed = 1;
+      break;
+    }
   }
-  password[length] = '\0';
 
-  free(rule30_buffer);
+  for (long i = 0; i < batch->count && !batch->failed; i++) {
+    char *password = batch->out + (batch->first + i) * (batch->length + 1);
+    if (combine_password(batch->rule30_buffer, rand_buffer + i * block, combined_buffer,
+                         password, batch->length) != 0) {
+      batch->failed = 1;
+    }
+    password[batch->length] = '\n';
+  }
+
+  // The random bytes are key material
+  memset(rand_buffer, 0, bytes);
+  free(rand_buffer);
   free(combined_buffer);
+  return NULL;
+}
+
+/*
+  Generates count passwords of length characters and prints them one per
+  line with a single write. rule30 depends on the block length only, so
+  it is run once for the whole batch. Large batches are shared out to threads,
+  each with its own RAND_bytes draw.
+ */
+void generate_passwords(long count, int length) {
+  size_t size = (size_t)count * (length + 1);
+  char *out = allocate(size, 1);
+  uint8_t *rule30_buffer = allocate(block_length(length), 1);
+  if (out == NULL || rule30_buffer == NULL) {
+    perror("Failed to allocate memory for passwords");
+    exit(1);
+  }
+  rule30(rule30_buffer, block_length(length));
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int threads = size < BATCH_THREAD_BYTES || cpus < 2 ? 1 : (cpus < BATCH_THREADS ? cpus : BATCH_THREADS);
+  if (threads > count) {
+    threads = count;
+  }
+  Batch batches[BATCH_THREADS];
+  for (int t = 0; t < threads; t++) {
+    long first = count * t / threads;
+    batches[t] = (Batch){.rule30_buffer = rule30_buffer, .out = out, .first = first,
+                         .count = count * (t + 1) / threads - first, .length = length};
+    batches[t].started = threads > 1 && pthread_create(&batches[t].thread, NULL, generate_batch, &batches[t]) == 0;
+    if (!batches[t].started) {
+      generate_batch(&batches[t]);
+    }
+  }
+  int failed = 0;
+  for (int t = 0; t < threads; t++) {
+    if (batches[t].started) {
+      pthread_join(batches[t].thread, NULL);
+    }
+    failed |= batches[t].failed;
+  }
+  if (failed) {
+    fprintf(stderr, "Failed to generate random bytes.\n");
+    exit(1);
+  }
+
+  if (fwrite(out, 1, size, stdout) != size || fflush(stdout) != 0) {
+    perror("Failed to write passwords");
+    exit(1);
+  }
+  memset(out, 0, size);
+  free(out);
+  free(rule30_buffer);
+}
+
+/*
+  The streaming interface, see passgen.h. The automaton of a context
+  never restarts: block after block carries on where rule30 would have
+  gone on, from the state the last block left.
+ */
+int passgen_init(passgen_ctx *ctx, const char *chars) {
+  memset(ctx, 0, sizeof(*ctx));
+  if (set_alphabet(&ctx->alphabet, chars ? chars : CHARSET, 0) != 0) {
+    return -1;
+  }
+  ctx->cells[PASSGEN_WORDS / 2] = 1;
+  ctx->pos = PASSGEN_BLOCK;
+  return 0;
+}
+
+// Mixes the next PASSGEN_BLOCK cells of the automaton with new random bytes
+static int passgen_block(passgen_ctx *ctx) {
+  rule30_run(ctx->cells, ctx->generation, ctx->rule30, PASSGEN_BLOCK);
+  ctx->generation += PASSGEN_BLOCK;
+  if (RAND_bytes(ctx->rand, PASSGEN_BLOCK) != 1) {
+    return -1;
+  }
+  complex_mix(ctx->rule30, ctx->rand, ctx->mixed, PASSGEN_BLOCK);
+  ctx->pos = 0;
+  return 0;
+}
+
+int passgen_read(passgen_ctx *ctx, char *out, size_t length) {
+  // The sampler runs on locals, out may alias anything for the compiler
+  const char *map = ctx->alphabet.map;
+  int width = ctx->alphabet.bits, pos = ctx->pos, available = ctx->available;
+  uint64_t bits = ctx->bits, mask = (1ULL << width) - 1;
+  int result = 0;
+  for (size_t i = 0; i < length;) {
+    if (available < width) {
+      if (pos == PASSGEN_BLOCK) {
+        if ((result = passgen_block(ctx)) != 0) break;
+        pos = 0;
+      }
+      bits |= (uint64_t)ctx->mixed[pos++] << available;
+      available += 8;
+      continue;
+    }
+    char c = map[bits & mask];
+    bits >>= width;
+    available -= width;
+    if (c) {
+      out[i++] = c;
+    }
+  }
+  ctx->pos = pos;
+  ctx->available = available;
+  ctx->bits = bits;
+  return result;
+}
+
+void passgen_free(passgen_ctx *ctx) {
+  // Nothing is allocated, but the state is key material
+  volatile uint8_t *p = (volatile uint8_t *)ctx;
+  for (size_t i = 0; i < sizeof(*ctx); i++) {
+    p[i] = 0;
+  }
+}
+
+#ifndef PASSGEN_LIBRARY
+static double monotonic_seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Lengths --bench tries
+#define BENCH_LENGTHS 7
+// Every measurement is repeated for at least BENCH_SECONDS
+#define BENCH_SECONDS 0.2
+
+enum { STAGE_RULE30, STAGE_MIX, STAGE_SAMPLE };
+
+// Runs one stage over length bytes, repeatedly, returns the bytes it produces per second
+static double bench_stage(int stage, uint8_t *cells, uint8_t *rand_buffer, uint8_t *mixed, char *out,
+                          int length, long *calls) {
+  double start = monotonic_seconds(), elapsed, bytes = 0;
+  *calls = 0;
+  do {
+    if (stage == STAGE_RULE30) {
+      rule30(cells, length);
+      bytes += length;
+    } else if (stage == STAGE_MIX) {
+      complex_mix(cells, rand_buffer, mixed, length);
+      bytes += length;
+    } else {
+      bytes += sample_chars(mixed, length, out, length);
+    }
+    ++*calls;
+  } while ((elapsed = monotonic_seconds() - start) < BENCH_SECONDS);
+  return bytes / elapsed;
+}
+
+/*
+  --bench: times rule30, complex_mix and the character sampling on their
+  own over lengths from 8 to 10^7 bytes, and counts the heap allocations
+  each makes per call. The sampling figure is in characters produced
+  from length mixed bytes.
+ */
+static int bench(void) {
+  static const int lengths[BENCH_LENGTHS] = {8, 100, 1000, 10000, 100000, 1000000, 10000000};
+  static const char *stages[] = {"rule30", "complex_mix", "sampling"};
+  int largest = lengths[BENCH_LENGTHS - 1];
+  uint8_t *cells = allocate(largest, 1), *rand_buffer = allocate(largest, 1), *mixed = allocate(largest, 1);
+  char *out = allocate(largest, 1);
+  if (cells == NULL || rand_buffer == NULL || mixed == NULL || out == NULL ||
+      RAND_bytes(rand_buffer, largest) != 1 || RAND_bytes(mixed, largest) != 1) {
+    fprintf(stderr, "Failed to set up the benchmark.\n");
+    return 1;
+  }
+  printf("%-12s %10s %10s %14s %12s\n", "stage", "length", "calls", "bytes/s", "allocs/call");
+  for (int stage = STAGE_RULE30; stage <= STAGE_SAMPLE; stage++) {
+    for (int i = 0; i < BENCH_LENGTHS; i++) {
+      long calls, before = allocations;
+      double rate = bench_stage(stage, cells, rand_buffer, mixed, out, lengths[i], &calls);
+      printf("%-12s %10d %10ld %14.4g %12.2f\n", stages[stage], lengths[i], calls, rate,
+             (double)(allocations - before) / calls);
+    }
+  }
+  free(cells);
+  free(rand_buffer);
+  free(mixed);
+  free(out);
+  return 0;
+}
+
+// Passwords --quality samples: QUALITY_CHARS characters in all
+#define QUALITY_CHARS (1 << 22)
+// Positions --quality checks one by one
+#define QUALITY_POSITIONS 64
+// p-values below this fail a check (split between the positions)
+#define QUALITY_ALPHA 0.001
+
+// Upper tail of the chi-square distribution, by the Wilson-Hilferty approximation
+static double chi_square_p(double x, int dof) {
+  double k = dof, z = (cbrt(x / k) - (1 - 2 / (9 * k))) / sqrt(2 / (9 * k));
+  return 0.5 * erfc(z / sqrt(2));
+}
+
+static double chi_square(const long *counts, int size, long total) {
+  double expected = (double)total / size, x = 0;
+  for (int c = 0; c < size; c++) {
+    x += (counts[c] - expected) * (counts[c] - expected) / expected;
+  }
+  return x;
+}
+
+/*
+  --quality: generates QUALITY_CHARS characters as passwords of length
+  characters, the way -n does, and checks them:
+  - the Shannon entropy per character, against log2 of the alphabet size;
+  - a chi-square test of the character frequencies against uniform;
+  - the same test at each of the first QUALITY_POSITIONS positions, since
+    the rule30 cells are the same for every password of a length.
+  Returns 1 if a test fails, so that it can gate changes to the mixer.
+ */
+static int quality(int length) {
+  long count = QUALITY_CHARS / length > 1000 ? QUALITY_CHARS / length : 1000;
+  int positions = length < QUALITY_POSITIONS ? length : QUALITY_POSITIONS;
+  int block = block_length(length);
+  char *out = allocate((size_t)count * (length + 1), 1);
+  uint8_t *rule30_buffer = allocate(block, 1);
+  long *counts = allocate((size_t)(positions + 1) * alphabet.size, sizeof(long));
+  if (out == NULL || rule30_buffer == NULL || counts == NULL) {
+    perror("Failed to allocate memory for the quality check");
+    return 1;
+  }
+  rule30(rule30_buffer, block);
+  Batch batch = {.rule30_buffer = rule30_buffer, .out = out, .count = count, .length = length};
+  generate_batch(&batch);
+  if (batch.failed) {
+    fprintf(stderr, "Failed to generate random bytes.\n");
+    return 1;
+  }
+
+  // counts[0 ..] over all the characters, counts[(p + 1) * size ..] at position p
+  int index[256] = {0};
+  for (int c = 0; c < alphabet.size; c++) {
+    index[(unsigned char)alphabet.map[c]] = c;
+  }
+  for (long i = 0; i < count; i++) {
+    for (int p = 0; p < length; p++) {
+      int c = index[(unsigned char)out[i * (length + 1) + p]];
+      counts[c]++;
+      if (p < positions) {
+        counts[(p + 1) * alphabet.size + c]++;
+      }
+    }
+  }
+  long total = count * length;
+
+  double entropy = 0;
+  for (int c = 0; c < alphabet.size; c++) {
+    double f = (double)counts[c] / total;
+    entropy -= f > 0 ? f * log2(f) : 0;
+  }
+  double x = chi_square(counts, alphabet.size, total), p = chi_square_p(x, alphabet.size - 1);
+  int failed = p < QUALITY_ALPHA;
+  printf("%ld passwords of %d characters, alphabet of %d\n", count, length, alphabet.size);
+  printf("entropy:   %.4f of %.4f bits per character\n", entropy, log2(alphabet.size));
+  printf("frequency: chi-square %.1f, %d degrees of freedom, p = %.4f%s\n", x, alphabet.size - 1, p,
+         failed ? "  FAILED" : "");
+
+  double worst = 1;
+  int worst_position = 0;
+  for (int i = 0; i < positions; i++) {
+    double q = chi_square_p(chi_square(counts + (i + 1) * alphabet.size, alphabet.size, count), alphabet.size - 1);
+    if (q < worst) {
+      worst = q;
+      worst_position = i;
+    }
+  }
+  int position_failed = worst < QUALITY_ALPHA / positions;
+  printf("positions: %d checked, lowest p = %.4f at position %d%s\n", positions, worst, worst_position,
+         position_failed ? "  FAILED" : "");
+  if (count < 5L * alphabet.size) {
+    printf("positions: too few passwords for %d characters, the test is weak\n", alphabet.size);
+  }
+
+  free(out);
+  free(rule30_buffer);
+  free(counts);
+  return failed || position_failed;
+}
+
+/*
+  --stream: writes length characters, or characters until the output is
+  closed if length is 0, a block at a time.
+ */
+static int stream_passwords(const char *chars, long length) {
+  passgen_ctx *ctx = allocate(1, sizeof(passgen_ctx));
+  char block[PASSGEN_BLOCK];
+  if (ctx == NULL || passgen_init(ctx, chars) != 0) {
+    fprintf(stderr, "Failed to set up the stream.\n");
+    return 1;
+  }
+  for (long written = 0; length == 0 || written < length;) {
+    size_t n = length == 0 || length - written > PASSGEN_BLOCK ? PASSGEN_BLOCK : (size_t)(length - written);
+    if (passgen_read(ctx, block, n) != 0) {
+      fprintf(stderr, "Failed to generate random bytes.\n");
+      return 1;
+    }
+    if (fwrite(block, 1, n, stdout) != n) {
+      break;
+    }
+    written += n;
+  }
+  if (length) {
+    putchar('\n');
+  }
+  passgen_free(ctx);
+  free(ctx);
+  memset(block, 0, sizeof(block));
+  return fflush(stdout) == 0 || length == 0 ? 0 : 1;
+}
+
+// Parses the classes of --require=, such as "upper,digit"; -1 if one is unknown
+static int parse_classes(char *text) {
+  int classes = 0;
+  for (char *name = strtok(text, ","); name; name = strtok(NULL, ",")) {
+    if (strcmp(name, "lower") == 0) classes |= CLASS_LOWER;
+    else if (strcmp(name, "upper") == 0) classes |= CLASS_UPPER;
+    else if (strcmp(name, "digit") == 0) classes |= CLASS_DIGIT;
+    else if (strcmp(name, "symbol") == 0) classes |= CLASS_SYMBOL;
+    else return -1;
+  }
+  return classes;
 }
 
 int main(int argc, char *argv[]) {
+  // Options may appear anywhere and are removed from argv
+  long count = 0;
+  const char *chars = CHARSET;
+  int required = 0, stream = 0, bench_mode = 0, quality_mode = 0;
+  int n = 1;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      if (!is_valid_integer(argv[++i]) || (count = atol(argv[i])) <= 0) {
+        fprintf(stderr, "Invalid count. It should be a positive integer.\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--stream") == 0) {
+      stream = 1;
+    } else if (strcmp(argv[i], "--bench") == 0) {
+      bench_mode = 1;
+    } else if (strcmp(argv[i], "--quality") == 0) {
+      quality_mode = 1;
+    } else if (strcmp(argv[i], "--alnum") == 0) {
+      chars = ALNUM;
+    } else if (strcmp(argv[i], "--hex") == 0) {
+      chars = HEX;
+    } else if (strcmp(argv[i], "--base64url") == 0) {
+      chars = BASE64URL;
+    } else if (strncmp(argv[i], "--charset=", 10) == 0) {
+      chars = argv[i] + 10;
+    } else if (strncmp(argv[i], "--require=", 10) == 0) {
+      if ((required = parse_classes(argv[i] + 10)) < 0) {
+        fprintf(stderr, "Unknown character class. Use lower, upper, digit or symbol.\n");
+        return 1;
+      }
+    } else {
+      argv[n++] = argv[i];
+    }
+  }
+  argc = n;
+  if (stream && (required || count)) {
+    fprintf(stderr, "--stream can't be combined with -n or --require=.\n");
+    return 1;
+  }
+  if (stream && argc == 1) {
+    return stream_passwords(chars, 0);
+  }
+  if (quality_mode && required) {
+    fprintf(stderr, "--quality checks the alphabet alone, --require= skews it on purpose.\n");
+    return 1;
+  }
+  if ((bench_mode || quality_mode) && set_alphabet(&alphabet, chars, required) != 0) {
+    fprintf(stderr, "The alphabet needs at least two characters, including the required classes.\n");
+    return 1;
+  }
+  if (bench_mode) {
+    return bench();
+  }
+  if (quality_mode && argc == 1) {
+    return quality(16);
+  }
   if (argc != 2) {
-    fprintf(stderr, "Usage: passgen <length>\n");
+    fprintf(stderr, "Usage: passgen [-n <count>] [--alnum|--hex|--base64url|--charset=<chars>] "
+            "[--require=<classes>] <length>\n"
+            "       passgen --stream [--alnum|--hex|--base64url|--charset=<chars>] [<length>]\n"
+            "       passgen --bench | --quality [<alphabet>] [<length>]\n");
+    return 1;
+  }
+  if (set_alphabet(&alphabet, chars, required) != 0) {
+    fprintf(stderr, "The alphabet needs at least two characters, including the required classes.\n");
     return 1;
   }
 
@@ -107,6 +689,21 @@ int main(int argc, char *argv[]) {
     fprintf(stderr, "Password length must be a positive integer.\n");
     return 1;
   }
+  if (password_len < __builtin_popcount(required)) {
+    fprintf(stderr, "Password length is too short for the required classes.\n");
+    return 1;
+  }
+
+  if (stream) {
+    return stream_passwords(chars, password_len);
+  }
+  if (quality_mode) {
+    return quality(password_len);
+  }
+  if (count) {
+    generate_passwords(count, password_len);
+    return 0;
+  }
 
   char *password = (char*)malloc((password_len + 1) * sizeof(char));
   if (password == NULL) {
@@ -120,3 +717,4 @@ int main(int argc, char *argv[]) {
   free(password);
   return 0;
 }
+#endif
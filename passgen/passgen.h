@@ -0,0 +1,68 @@
+/*
+ * passgen.h
+ *
+ * Description: The streaming interface of passgen, for programs that need
+ *              a steady supply of password characters in-process.
+ *
+ * Build passgen.c with -DPASSGEN_LIBRARY to leave out main and link it in:
+ *
+ *   passgen_ctx ctx;
+ *   if (passgen_init(&ctx, NULL) != 0) ...
+ *   passgen_read(&ctx, token, sizeof(token));
+ *   passgen_free(&ctx);
+ *
+ * A context produces characters in blocks of PASSGEN_BLOCK: every block
+ * takes PASSGEN_BLOCK new random bytes and the next PASSGEN_BLOCK cells
+ * of a rule30 automaton that carries on from block to block, mixes them
+ * and samples characters from the result. Memory use is constant however
+ * much is read. A context is used by one thread at a time.
+ */
+#ifndef PASSGEN_H
+#define PASSGEN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PASSGEN_BLOCK 4096
+// Width of the automaton of a context
+#define PASSGEN_CELLS 256
+#define PASSGEN_WORDS (PASSGEN_CELLS / 64)
+
+/*
+  The alphabet passwords are drawn from. Characters are picked by
+  rejection sampling: bits at a time are taken from the mixed bytes, the
+  smallest number of them that can index every character, and values
+  past the end of the alphabet are thrown away, so every character is
+  equally likely. map is the table from those values to characters, 0
+  for the rejected ones. It is built once, by set_alphabet.
+ */
+typedef struct {
+  char map[256];
+  int size, bits;
+  int required;
+} Alphabet;
+
+typedef struct {
+  Alphabet alphabet;
+  // The automaton, PASSGEN_CELLS cells fixed at 0 past both ends, and its generation
+  uint64_t cells[PASSGEN_WORDS];
+  unsigned long generation;
+  // The block being sampled, and the bits taken from it but not used yet
+  uint8_t rule30[PASSGEN_BLOCK], rand[PASSGEN_BLOCK], mixed[PASSGEN_BLOCK];
+  int pos, available;
+  uint64_t bits;
+} passgen_ctx;
+
+/*
+  passgen_init: Set up a context for the characters of chars (NULL for the default
+                letters, digits and symbols). Returns 0, or -1 for an alphabet of
+                fewer than two characters.
+  passgen_read: Write length characters to out, without a terminating 0. Returns 0,
+                or -1 if RAND_bytes fails.
+  passgen_free: Wipe the context.
+ */
+int passgen_init(passgen_ctx *ctx, const char *chars);
+int passgen_read(passgen_ctx *ctx, char *out, size_t length);
+void passgen_free(passgen_ctx *ctx);
+
+#endif
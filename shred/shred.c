@@ -8,7 +8,7 @@
  *
  * The deletion process is as follows:
  * 1. The overwriting procedure (in secure mode) performs 38 overwriting passes. 
- *    After each pass, the disk cache is flushed.
+ *    After each pass, the disk cache is flushed (see --sync= for other policies).
  * 2. The file is truncated to zero size so that an attacker cannot determine which disk blocks belonged to the file.
  * 3. The file is renamed so that an attacker cannot infer the contents of the deleted file from its name.
  * 4. Finally, the file is deleted (unlinked).
@@ -16,12 +16,18 @@
  * Note: By default, all shred utilities work in secure mode (38 special passes). 
  * To lower the security and make the process faster, you may add thae -l (one 0xff pass, one random pass) 
  * or -ll (one random pass) option to the parameters.
+ * --progress (or --progress=json) reports the passes as they go, and --bench measures the
+ * write rate of a file system and how long the passes would take, without deleting anything.
+ * sswap --offload lets a block device erase itself (BLKSECDISCARD or BLKZEROOUT) instead.
+ * --interleave applies all the passes to one slice of the target before moving on to the next,
+ * which saves a full sweep of the disk per pass on rotational media.
  *
  * Warning:
  * - Use these utilities with caution as they irreversibly delete data.
  * - This program has only been tested on Linux systems so far.
  * - USE THE PROGRAM AT YOUR OWN RISK!!!
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -32,134 +38,836 @@
 #include <errno.h>
 #include <sys/vfs.h>
 #include <sys/swap.h> 
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/random.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <ftw.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <libgen.h>
+#include <time.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+#endif
+
+// Size of the blocks each pass is written in, see --chunk=
+#define DEFAULT_CHUNK_SIZE (4 << 20)
+#define MIN_CHUNK_SIZE (4 << 10)
+#define MAX_CHUNK_SIZE (1 << 30)
+#define MAX_QUEUE_DEPTH 64
+
+// Files srm works on at the same time, see --jobs=
+#define MAX_JOBS 64
+
+/*
+  sfill claims the free space in fill files of at least SFILL_FILE_SIZE
+  bytes, at most SFILL_FILES of them, with SFILL_JOBS files written at a
+  time by default. It stops SFILL_RESERVE bytes short of a full file
+  system, so that the rest of the system keeps working meanwhile, then
+  claims those last bytes itself in up to SFILL_LAST_FILES more files.
+ */
+#define SFILL_FILE_SIZE (1LL << 30)
+#define SFILL_FILES 512
+#define SFILL_LAST_FILES 64
+#define SFILL_JOBS 4
+#define SFILL_RESERVE (16 << 20)
+
+// Alignment of O_DIRECT writes; a tail shorter than this goes through the page cache
+#define DIRECT_ALIGN 4096
+
+/*
+  I/O engines of write_pass, see --io=
+  IO_URING:   io_uring, with up to queue_depth writes in flight
+  IO_THREADS: queue_depth threads, each doing pwrite (fallback when io_uring is not available)
+  IO_SYNC:    one pwrite at a time
+ */
+enum { IO_URING, IO_THREADS, IO_SYNC };
+
+size_t chunk_size = DEFAULT_CHUNK_SIZE;
+int queue_depth = 4;
+int io_engine = IO_URING;
+int use_direct = 1;
+int jobs = 0;
+
+/*
+  When the passes are flushed to the disk, see --sync=
+  SYNC_PASS:  after every pass, so each one is on the disk before the next
+              begins (default)
+  SYNC_EVERY: write-back (a flush with O_DIRECT) every sync_every bytes, and
+              a flush after the last pass
+  SYNC_END:   once, after the last pass. Only with O_DIRECT: buffered
+              passes rewrite the same pages of the page cache, and all
+              but the last could never reach the disk, so the files (or
+              unaligned ranges) that can't bypass the cache still get
+              a flush after every pass
+  Buffered passes are written in windows of SYNC_WINDOW (sync_every for
+  SYNC_EVERY) bytes: write-back of each window starts as soon as it is
+  written and is waited for after the next one, so the device keeps
+  streaming and the final flush has little left to do.
+ */
+enum { SYNC_PASS, SYNC_EVERY, SYNC_END };
+
+#define SYNC_WINDOW (32 << 20)
+
+int sync_policy = SYNC_PASS;
+size_t sync_every;
+
+/*
+  Progress reports on stderr, see --progress=
+  PROGRESS_TEXT: a status line every PROGRESS_INTERVAL seconds and a line per pass
+  PROGRESS_JSON: the same as JSON lines, for dashboards
+  --bench measures the write rate with a pass over BENCH_SIZE bytes instead.
+ */
+enum { PROGRESS_NONE, PROGRESS_TEXT, PROGRESS_JSON };
+
+#define PROGRESS_INTERVAL 1
+#define BENCH_SIZE (1LL << 30)
+
+int progress = PROGRESS_NONE;
+int bench_mode = 0;
+
+/*
+  How sswap erases a block device, see --offload=
+  OFFLOAD_NONE:       the passes of the security level (default)
+  OFFLOAD_AUTO:       BLKSECDISCARD, else BLKZEROOUT, else the passes
+  OFFLOAD_SECDISCARD: BLKSECDISCARD only, the device erases the blocks and their old copies
+  OFFLOAD_ZEROOUT:    BLKZEROOUT only, the device writes zeros (WRITE ZEROES where supported)
+ */
+enum { OFFLOAD_NONE, OFFLOAD_AUTO, OFFLOAD_SECDISCARD, OFFLOAD_ZEROOUT };
+
+int offload = OFFLOAD_NONE;
+
+/*
+  With --interleave the passes are applied slice by slice instead of one
+  after the other over the whole target: every pattern over a slice of
+  SYNC_WINDOW (sync_every for SYNC_EVERY) bytes, each followed by a
+  flush, then the next slice. The target is still rewritten in place by
+  every pattern, but a disk head sweeps it once rather than once per pass.
+ */
+int interleave = 0;
+
+// A part of a target to overwrite: all of it, or one of the extents of a file
+typedef struct {
+  off_t offset, length;
+} Range;
+
+// Bytes written by all the passes so far, out of the bytes planned by the overwrites started
+atomic_llong bytes_written, bytes_planned;
+
+// Time spent waiting for flushes, in all threads (nanoseconds) and in this one
+static atomic_llong sync_nanos;
+static _Thread_local double thread_sync_seconds;
+
+// Pattern of the random passes, see take_data
+#define PATTERN_RANDOM -2
+
+// One buffer per write in flight, each filled with the byte in pattern (-1 if not filled yet)
+typedef struct {
+  char *data;
+  size_t length;
+  int pattern;
+} Buffer;
+
+/*
+  The buffers of the overwrite running in this thread: srm overwrites
+  several files at once, one per worker thread.
+ */
+_Thread_local Buffer buffers[MAX_QUEUE_DEPTH];
+_Thread_local size_t buffer_length;
+
+/*
+  The system call that failed last in this thread and its errno. The
+  functions working on one target return -1 through failure() instead of
+  exiting, so srm can report the error and carry on with the next file.
+ */
+static _Thread_local const char *failed_call;
+static _Thread_local int failed_errno;
+
+static int failure(const char *call) {
+  failed_call = call;
+  failed_errno = errno;
+  return -1;
+}
+
+static void report_failure(const char *path) {
+  fprintf(stderr, "%s: %s: %s\n", path, failed_call, strerror(failed_errno));
+}
 
 /*
   Function declarations
   
   srm:   Securely delete a file.
-  sfill: Securely overwrite the unused disk space.
+  sfill: Securely overwrite the unused space of a file system.
   sswap: Securely overwrite and clean the swap space.
   smem:  Securely overwrite the unused memory (RAM).
+  srm_paths: Securely delete many files, and directory trees with -r, several at a time.
   
-  secure_overwrite:    Perform secure overwriting of a file descriptor.
+  secure_overwrite:    Perform secure overwriting of ranges of a file descriptor.
+  write_pass:          Write one pattern over ranges of a file descriptor, chunk by chunk.
+  write_interleaved:   Write all the patterns slice by slice, for --interleave.
+  pass_patterns:       Choose the patterns of the passes.
+  buffers_alloc:       Allocate the write buffers of the calling thread.
+  buffers_free:        Free them.
+  file_extents:        Find the allocated ranges of a file.
+  open_target:         Open a file for overwriting, with O_DIRECT if possible.
+  bypasses_cache:      Check that the passes over ranges of a file skip the page cache.
+  target_size:         Find the size of a file or a device.
+  offload_erase:       Let a block device erase itself for --offload=.
+  report_method:       Report how a target was erased.
+  sync_target:         Flush a file descriptor to the disk.
+  ring_close:          Close the io_uring of the calling thread.
+  random_start:        Key the random pattern generator.
+  random_stop:         Stop the generator threads and wipe the key.
+  parse_size:          Parse a size such as 4096, 512K or 16M.
+  format_size:         Format a size the same way, such as 1.5G.
+  json_string:         Write a string as a JSON string.
+  monotonic_seconds:   Read the monotonic clock.
+  progress_start:      Start reporting the progress of --progress.
+  progress_stop:       Stop reporting it, with a last status line.
+  report_pass:         Report a finished pass.
+  bench:               Measure the write rate of a file system for --bench.
   truncate_and_rename: Truncate a file and rename it to an unknown name.
   handle_error:        Handle errors by printing an error message and exiting.
+
+  The functions working on one target (srm, secure_overwrite, write_pass,
+  truncate_and_rename) return 0, or -1 after failure().
  */
-void srm(const char *filepath, int level);
-void sfill(int level);
+int srm(const char *filepath, int level);
+int srm_paths(char **paths, int count, int level, int recursive);
+int sfill(const char *mount_point, int level);
 void sswap(const char *swap_partition, int level);
 void smem(int level);
 
-void secure_overwrite(int fd, off_t size, int passes);
-void truncate_and_rename(const char *filepath);
+int secure_overwrite(int fd, const char *name, const Range *ranges, int count, int passes);
+int write_pass(int fd, const Range *ranges, int count, int pattern);
+int write_interleaved(int fd, const char *name, const Range *ranges, int count,
+                      const int *patterns, int pattern_count, off_t size);
+int pass_patterns(int passes, int patterns[38]);
+int buffers_alloc(off_t size);
+void buffers_free(void);
+int file_extents(int fd, off_t size, Range **ranges);
+int open_target(const char *path);
+int bypasses_cache(int fd, const Range *ranges, int count);
+int target_size(int fd, off_t *size);
+const char *offload_erase(int fd, off_t size);
+void report_method(const char *name, const char *method, off_t bytes, double seconds);
+int sync_target(int fd);
+void ring_close(void);
+void random_start(void);
+void random_stop(void);
+size_t parse_size(const char *text);
+void format_size(long long bytes, char *text, size_t length);
+void json_string(FILE *out, const char *text);
+double monotonic_seconds(void);
+void progress_start(void);
+void progress_stop(void);
+void report_pass(const char *name, int pass, int passes, int pattern, off_t bytes, double seconds, double sync);
+int bench(const char *dir, int level);
+int truncate_and_rename(const char *filepath);
 void handle_error(const char *message);
 
 int main(int argc, char **argv) {
-  if (argc < 2) {
-    fprintf(stderr, "Usage: %s <command> [options]\n", argv[0]);
+  // Options may appear anywhere and are removed from argv
+  int level = 0, recursive = 0;
+  int n = 1;
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--chunk=", 8) == 0) {
+      chunk_size = parse_size(argv[i] + 8);
+      if (chunk_size < MIN_CHUNK_SIZE || chunk_size > MAX_CHUNK_SIZE) {
+        fprintf(stderr, "Invalid chunk size: %s (4K to 1G)\n", argv[i] + 8);
+        return EXIT_FAILURE;
+      }
+    } else if (strncmp(argv[i], "--queue-depth=", 14) == 0) {
+      queue_depth = atoi(argv[i] + 14);
+      if (queue_depth < 1 || queue_depth > MAX_QUEUE_DEPTH) {
+        fprintf(stderr, "Invalid queue depth: %s (1 to %d)\n", argv[i] + 14, MAX_QUEUE_DEPTH);
+        return EXIT_FAILURE;
+      }
+    } else if (strncmp(argv[i], "--io=", 5) == 0) {
+      if (strcmp(argv[i] + 5, "uring") == 0) {
+        io_engine = IO_URING;
+      } else if (strcmp(argv[i] + 5, "threads") == 0) {
+        io_engine = IO_THREADS;
+      } else if (strcmp(argv[i] + 5, "sync") == 0) {
+        io_engine = IO_SYNC;
+      } else {
+        fprintf(stderr, "Unknown I/O engine: %s (uring, threads or sync)\n", argv[i] + 5);
+        return EXIT_FAILURE;
+      }
+    } else if (strcmp(argv[i], "--no-direct") == 0) {
+      use_direct = 0;
+    } else if (strncmp(argv[i], "--sync=", 7) == 0) {
+      if (strcmp(argv[i] + 7, "pass") == 0) {
+        sync_policy = SYNC_PASS;
+      } else if (strcmp(argv[i] + 7, "end") == 0) {
+        sync_policy = SYNC_END;
+      } else if ((sync_every = parse_size(argv[i] + 7)) >= MIN_CHUNK_SIZE) {
+        sync_policy = SYNC_EVERY;
+      } else {
+        fprintf(stderr, "Invalid sync policy: %s (pass, end or a size of at least 4K)\n", argv[i] + 7);
+        return EXIT_FAILURE;
+      }
+    } else if (strncmp(argv[i], "--jobs=", 7) == 0) {
+      jobs = atoi(argv[i] + 7);
+      if (jobs < 1 || jobs > MAX_JOBS) {
+        fprintf(stderr, "Invalid number of jobs: %s (1 to %d)\n", argv[i] + 7, MAX_JOBS);
+        return EXIT_FAILURE;
+      }
+    } else if (strcmp(argv[i], "--progress") == 0 || strcmp(argv[i], "--progress=text") == 0) {
+      progress = PROGRESS_TEXT;
+    } else if (strcmp(argv[i], "--progress=json") == 0) {
+      progress = PROGRESS_JSON;
+    } else if (strcmp(argv[i], "--bench") == 0) {
+      bench_mode = 1;
+    } else if (strcmp(argv[i], "--interleave") == 0) {
+      interleave = 1;
+    } else if (strcmp(argv[i], "--offload") == 0) {
+      offload = OFFLOAD_AUTO;
+    } else if (strcmp(argv[i], "--offload=secdiscard") == 0) {
+      offload = OFFLOAD_SECDISCARD;
+    } else if (strcmp(argv[i], "--offload=zeroout") == 0) {
+      offload = OFFLOAD_ZEROOUT;
+    } else if (strcmp(argv[i], "-l") == 0) {
+      // Lower security levels
+      level = 1;
+    } else if (strcmp(argv[i], "-ll") == 0) {
+      level = 2;
+    } else if (strcmp(argv[i], "-r") == 0) {
+      recursive = 1;
+    } else {
+      argv[n++] = argv[i];
+    }
+  }
+  argc = n;
+  argv[argc] = NULL;
+  if (sync_policy == SYNC_END && !use_direct) {
+    fprintf(stderr, "--sync=end needs O_DIRECT: without it only the last pass is sure to reach the disk\n");
     return EXIT_FAILURE;
   }
 
-  // Default security level
-  int level = 0; 
-  if (argc == 4 && strcmp(argv[3], "-l") == 0) {
-    level = 1;
-  } else if (argc == 4 && strcmp(argv[3], "-ll") == 0) {
-    level = 2;
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <command> [options]\n", argv[0]);
+    return EXIT_FAILURE;
   }
 
   // Determine which command to execute
-  if (strcmp(argv[1], "srm") == 0) {
+  int status = EXIT_SUCCESS;
+  random_start();
+  if (bench_mode) {
+    // On the file system of the first path, or of its contents for a directory
+    struct stat st;
+    char *dir = argc < 3 ? "/" : strdup(argv[2]);
+    if (argc >= 3 && (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode))) {
+      dir = dirname(dir);
+    }
+    if (strcmp(argv[1], "srm") != 0 && strcmp(argv[1], "sfill") != 0) {
+      fprintf(stderr, "--bench works with srm and sfill\n");
+      return EXIT_FAILURE;
+    }
+    if (bench(dir, level) != 0) {
+      status = EXIT_FAILURE;
+    }
+  } else if (strcmp(argv[1], "srm") == 0) {
     if (argc < 3) {
-      fprintf(stderr, "Usage: %s srm <file_path> [-l|-ll]\n", argv[0]);
+      fprintf(stderr, "Usage: %s srm [-r] <path>... [-l|-ll]\n", argv[0]);
       return EXIT_FAILURE;
     }
-    srm(argv[2], level);
+    progress_start();
+    if (srm_paths(argv + 2, argc - 2, level, recursive) != 0) {
+      status = EXIT_FAILURE;
+    }
   } else if (strcmp(argv[1], "sfill") == 0) {
-    sfill(level);
+    if (argc > 3) {
+      fprintf(stderr, "Usage: %s sfill [<mount_point>] [-l|-ll]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+    progress_start();
+    if (sfill(argc == 3 ? argv[2] : "/", level) != 0) {
+      status = EXIT_FAILURE;
+    }
   } else if (strcmp(argv[1], "sswap") == 0) {
     if (argc < 3) {
       fprintf(stderr, "Usage: %s sswap <swap_partition> [-l|-ll]\n", argv[0]);
       return EXIT_FAILURE;
     }
+    progress_start();
     sswap(argv[2], level);
   } else if (strcmp(argv[1], "smem") == 0) {
+    progress_start();
     smem(level);
   } else {
     fprintf(stderr, "Unknown command: %s\n", argv[1]);
     return EXIT_FAILURE;
   }
+  progress_stop();
+  random_stop();
 
-  return EXIT_SUCCESS;
+  return status;
 }
 
+// Number, total size and allocated size of the files srm overwrote
+static atomic_int srm_files;
+static atomic_llong srm_size, srm_allocated;
+
 /*
   Securely deletes a file by overwriting it, truncating it, renaming it, and finally deleting it.
   1. Uses stat to get file size and open to get a file descriptor.
-  2. Calls secure_overwrite to overwrite the file contents.
-  3. Calls truncate_and_rename to truncate and rename the file.
-  4. Uses unlink to delete the file.
+  2. Uses file_extents to find the blocks the file really has, so that
+     holes in sparse files are not filled in.
+  3. Calls secure_overwrite to overwrite the file contents.
+  4. Calls truncate_and_rename to truncate and rename the file.
+  5. Uses unlink to delete the file.
  */
-void srm(const char *filepath, int level) {
+int srm(const char *filepath, int level) {
   struct stat st;
   if (stat(filepath, &st) != 0) {
-    perror("stat");
-    exit(EXIT_FAILURE);
+    return failure("stat");
   }
 
-  int fd = open(filepath, O_WRONLY);
+  int fd = open_target(filepath);
   if (fd < 0) {
-    perror("open");
-    exit(EXIT_FAILURE);
+    return failure("open");
+  }
+
+  Range *ranges;
+  int count = file_extents(fd, st.st_size, &ranges);
+  if (count < 0) {
+    close(fd);
+    return -1;
   }
+  off_t allocated = 0;
+  for (int i = 0; i < count; i++) {
+    allocated += ranges[i].length;
+  }
+  atomic_fetch_add(&srm_files, 1);
+  atomic_fetch_add(&srm_size, st.st_size);
+  atomic_fetch_add(&srm_allocated, allocated);
 
   // Determine the number of overwrite passes based on security level
   int passes = level == 0 ? 38 : (level == 1 ? 2 : 1);
-  secure_overwrite(fd, st.st_size, passes);
-  truncate_and_rename(filepath);
+  int result = secure_overwrite(fd, filepath, ranges, count, passes);
+  free(ranges);
+  if (result == 0) {
+    result = truncate_and_rename(filepath);
+  }
 
   // Unlink (delete) the file
-  if (unlink(filepath) != 0) {
-    perror("unlink");
-    exit(EXIT_FAILURE);
+  if (result == 0 && unlink(filepath) != 0) {
+    result = failure("unlink");
   }
 
   close(fd);
+  return result;
 }
 
 /*
-  Securely overwrites the unused disk space.
-  1. Uses open to get a file descriptor for /dev/zero.
-  2. Uses statfs to get the free space available on the disk.
-  3. Calls secure_overwrite to overwrite the unused space.
+  What srm_paths removes: regular files are overwritten first, anything
+  else (symbolic links, fifos, device nodes found under -r) is only
+  unlinked. Directories are removed once everything in them is gone.
  */
-void sfill(int level) {
-  int fd = open("/dev/zero", O_WRONLY);
-  if (fd < 0) {
-    perror("open");
+typedef struct {
+  char *path;
+  int overwrite;
+} Entry;
+
+static Entry *entries;
+static size_t entry_count, entry_capacity;
+static char **directories;
+static size_t directory_count, directory_capacity;
+static int walk_failures;
+
+static void add_entry(const char *path, int overwrite) {
+  if (entry_count == entry_capacity) {
+    entry_capacity = entry_capacity ? 2 * entry_capacity : 256;
+    entries = realloc(entries, entry_capacity * sizeof(Entry));
+  }
+  char *copy = strdup(path);
+  if (!entries || !copy) {
+    perror("malloc");
     exit(EXIT_FAILURE);
   }
+  entries[entry_count++] = (Entry){copy, overwrite};
+}
 
-  int passes = level == 0 ? 38 : (level == 1 ? 2 : 1);
+static void add_directory(const char *path) {
+  if (directory_count == directory_capacity) {
+    directory_capacity = directory_capacity ? 2 * directory_capacity : 64;
+    directories = realloc(directories, directory_capacity * sizeof(char *));
+  }
+  char *copy = strdup(path);
+  if (!directories || !copy) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  directories[directory_count++] = copy;
+}
+
+// nftw callback; FTW_DEPTH lists every directory after its contents
+static int walk_entry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+  (void)ftw;
+  if (type == FTW_DP) {
+    add_directory(path);
+  } else if (type == FTW_DNR || type == FTW_NS) {
+    fprintf(stderr, "%s: %s\n", path, type == FTW_DNR ? "cannot read directory" : "cannot stat");
+    walk_failures++;
+  } else {
+    add_entry(path, S_ISREG(st->st_mode));
+  }
+  return 0;
+}
+
+static int srm_level;
+static atomic_size_t next_entry;
+static atomic_int failed_entries;
+
+static void *srm_worker(void *unused) {
+  (void)unused;
+  size_t i;
+  while ((i = atomic_fetch_add(&next_entry, 1)) < entry_count) {
+    Entry *entry = &entries[i];
+    int result = entry->overwrite ? srm(entry->path, srm_level)
+                                  : (unlink(entry->path) == 0 ? 0 : failure("unlink"));
+    if (result != 0) {
+      report_failure(entry->path);
+      atomic_fetch_add(&failed_entries, 1);
+    }
+  }
+  ring_close();
+  return NULL;
+}
+
+/*
+  Securely deletes every path, walking directories with -r. The files
+  are shared out to a pool of --jobs= worker threads (one per core by
+  default), each running srm on one file at a time. A file that fails is
+  reported and left behind, and the others are still deleted.
+  Returns -1 if anything could not be removed.
+ */
+int srm_paths(char **paths, int count, int level, int recursive) {
+  for (int i = 0; i < count; i++) {
+    struct stat st;
+    if (lstat(paths[i], &st) != 0) {
+      fprintf(stderr, "%s: %s\n", paths[i], strerror(errno));
+      walk_failures++;
+    } else if (!S_ISDIR(st.st_mode)) {
+      // A link to a file given by name is followed, as srm always did
+      struct stat target;
+      add_entry(paths[i], stat(paths[i], &target) == 0 && S_ISREG(target.st_mode));
+    } else if (!recursive) {
+      fprintf(stderr, "%s: %s (use -r)\n", paths[i], strerror(EISDIR));
+      walk_failures++;
+    } else if (nftw(paths[i], walk_entry, 64, FTW_DEPTH | FTW_PHYS) != 0) {
+      fprintf(stderr, "%s: %s\n", paths[i], strerror(errno));
+      walk_failures++;
+    }
+  }
+
+  srm_level = level;
+  int workers = jobs ? jobs : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (workers > MAX_JOBS) {
+    workers = MAX_JOBS;
+  }
+  if ((size_t)workers > entry_count) {
+    workers = entry_count;
+  }
+  pthread_t threads[MAX_JOBS];
+  int started = 0;
+  while (started < workers - 1 && pthread_create(&threads[started], NULL, srm_worker, NULL) == 0) {
+    started++;
+  }
+  srm_worker(NULL);
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  // Holes are not written, so the allocated size is what was really overwritten
+  if (srm_files) {
+    char size[16], allocated[16], written[16];
+    format_size(srm_size, size, sizeof(size));
+    format_size(srm_allocated, allocated, sizeof(allocated));
+    format_size(bytes_written, written, sizeof(written));
+    printf("Overwrote %s allocated of %s in %d files (%s written)\n", allocated, size, (int)srm_files, written);
+  }
+
+  // Contents before their directory; a directory still holding a failed file stays
+  for (size_t i = 0; i < directory_count; i++) {
+    if (rmdir(directories[i]) != 0) {
+      fprintf(stderr, "%s: rmdir: %s\n", directories[i], strerror(errno));
+      walk_failures++;
+    }
+    free(directories[i]);
+  }
+  for (size_t i = 0; i < entry_count; i++) {
+    free(entries[i].path);
+  }
+  free(directories);
+  free(entries);
+  return walk_failures || failed_entries ? -1 : 0;
+}
+
+/*
+  The fill files of sfill. They never have a name (O_TMPFILE, or
+  unlinked right after mkstemp), so the space comes back even if sfill
+  is killed, and all of them stay open until the free space is used up:
+  a fill file closed early would free blocks that the next one might
+  get again instead of the ones not overwritten yet.
+ */
+static struct {
+  const char *dir;
+  int passes;
+  off_t file_size, reserve;
+  int fds[SFILL_FILES + SFILL_LAST_FILES];
+  int count, failed;
+  atomic_int full;
+  pthread_mutex_t lock;
+} fill = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static int open_fill_file(const char *dir) {
+  int fd = use_direct ? open(dir, O_TMPFILE | O_WRONLY | O_DIRECT, 0600) : -1;
+  if (fd < 0) {
+    fd = open(dir, O_TMPFILE | O_WRONLY, 0600);
+  }
+  if (fd >= 0) {
+    return fd;
+  }
+
+  // No O_TMPFILE on this file system
+  char path[PATH_MAX];
+  if (snprintf(path, sizeof(path), "%s/.sfillXXXXXX", dir) >= (int)sizeof(path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  fd = mkstemp(path);
+  if (fd < 0) {
+    return -1;
+  }
+  unlink(path);
+  if (use_direct) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT);
+  }
+  return fd;
+}
+
+// The free space sfill can take: root may also use the blocks reserved for it
+static off_t fill_free_space(const struct statfs *st) {
+  return (off_t)(geteuid() == 0 ? st->f_bfree : st->f_bavail) * st->f_bsize;
+}
+
+/*
+  Claims the next fill file: as much of the free space as is left above
+  fill.reserve, up to fill.file_size, preallocated with fallocate.
+  Returns its size and file descriptor, 0 once the file system is full,
+  or -1 after failure(). Runs under fill.lock, so the workers don't
+  race each other for the last free blocks.
+ */
+static off_t claim_fill_file(int *fd) {
+  struct statfs st;
+  if (statfs(fill.dir, &st) != 0) {
+    return failure("statfs");
+  }
+  off_t room = fill_free_space(&st) - fill.reserve;
+  off_t size = room < fill.file_size ? room / DIRECT_ALIGN * DIRECT_ALIGN : fill.file_size;
+  // The last files keep a slot for fill_last_file
+  int limit = fill.reserve ? SFILL_FILES : SFILL_FILES + SFILL_LAST_FILES - 1;
+  if (size < DIRECT_ALIGN || fill.count >= limit) {
+    return 0;
+  }
+
+  if ((*fd = open_fill_file(fill.dir)) < 0) {
+    return failure("open");
+  }
+  // A file system that limits the file size gets smaller files
+  while (fallocate(*fd, 0, 0, size) != 0) {
+    if (errno == EOPNOTSUPP) {
+      // Not preallocated: the first pass allocates the blocks and may run into ENOSPC
+      break;
+    }
+    if ((errno != EFBIG && errno != ENOSPC) || size / 2 < DIRECT_ALIGN) {
+      int saved_errno = errno;
+      close(*fd);
+      errno = saved_errno;
+      return saved_errno == ENOSPC ? 0 : failure("fallocate");
+    }
+    size = size / 2 / DIRECT_ALIGN * DIRECT_ALIGN;
+  }
+  fill.fds[fill.count++] = *fd;
+  return size;
+}
+
+static void *sfill_worker(void *unused) {
+  (void)unused;
+  while (!atomic_load(&fill.full)) {
+    int fd;
+    pthread_mutex_lock(&fill.lock);
+    off_t size = claim_fill_file(&fd);
+    pthread_mutex_unlock(&fill.lock);
+
+    // Running out of space while writing a file that could not be preallocated just means full
+    Range all = {0, size};
+    int result = size > 0 ? secure_overwrite(fd, fill.dir, &all, 1, fill.passes) : (int)size;
+    if (result != 0 && (size < 0 || failed_errno != ENOSPC)) {
+      report_failure(fill.dir);
+      fill.failed = 1;
+    }
+    if (result != 0 || size == 0) {
+      atomic_store(&fill.full, 1);
+    }
+  }
+  ring_close();
+  return NULL;
+}
+
+/*
+  ext4 holds reserved_clusters blocks back from everyone, root included,
+  for the metadata of later writes, so no fill file gets them, however
+  much of a removed file they hold. Sets the reserve of the file system
+  dir is on to value, and returns its old value in *old, or returns -1
+  if it has no such setting.
+ */
+static int set_ext4_reserve(const char *dir, long value, long *old) {
+  struct stat st;
+  char link[PATH_MAX], device[PATH_MAX], path[PATH_MAX];
+  if (stat(dir, &st) != 0) {
+    return -1;
+  }
+  snprintf(link, sizeof(link), "/sys/dev/block/%u:%u", major(st.st_dev), minor(st.st_dev));
+  ssize_t length = readlink(link, device, sizeof(device) - 1);
+  if (length < 0) {
+    return -1;
+  }
+  device[length] = 0;
+  snprintf(path, sizeof(path), "/sys/fs/ext4/%s/reserved_clusters", basename(device));
+
+  FILE *file = fopen(path, "r+");
+  if (!file) {
+    return -1;
+  }
+  int result = fscanf(file, "%ld", old) == 1 && fseek(file, 0, SEEK_SET) == 0 &&
+               fprintf(file, "%ld\n", value) > 0 ? 0 : -1;
+  return fclose(file) == 0 ? result : -1;
+}
+
+/*
+  The last fill file, for the blocks fallocate could not claim: written
+  through the page cache, a block at a time, until the file system
+  reports ENOSPC even after a flush, then overwritten with the passes
+  like the others. The blocks of the ext4 reserve are claimed too, with
+  the reserve lifted only while this file grows: the passes write blocks
+  it already has and need none of it.
+ */
+static void fill_last_file(void) {
+  struct statfs st;
+  int fd = open_fill_file(fill.dir);
+  if (fd < 0) {
+    return;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+  fill.fds[fill.count++] = fd;
+
+  size_t block = statfs(fill.dir, &st) == 0 ? (size_t)st.f_bsize : DIRECT_ALIGN;
+  char *zeros = calloc(1, block);
+  long reserve;
+  int lifted = geteuid() == 0 && set_ext4_reserve(fill.dir, 0, &reserve) == 0;
+  off_t size = 0, flushed = -1;
+  ssize_t written;
+  // Delayed allocation holds blocks back for metadata it may need, until the flush gives them up
+  while (zeros && size > flushed) {
+    flushed = size;
+    while ((written = pwrite(fd, zeros, block, size)) > 0) {
+      size += written;
+    }
+    fdatasync(fd);
+  }
+  free(zeros);
+  if (lifted && set_ext4_reserve(fill.dir, reserve, &reserve) != 0) {
+    fprintf(stderr, "%s: could not restore the ext4 reserved_clusters\n", fill.dir);
+  }
+  // Keep only the blocks that did fit
+  struct stat file;
+  if (fstat(fd, &file) == 0 && (off_t)file.st_blocks * 512 < size) {
+    size = (off_t)file.st_blocks * 512;
+  }
+
+  Range all = {0, size};
+  if (size > 0 && secure_overwrite(fd, fill.dir, &all, 1, fill.passes) != 0 && failed_errno != ENOSPC) {
+    report_failure(fill.dir);
+    fill.failed = 1;
+  }
+}
+
+/*
+  Securely overwrites the unused space of the file system mount_point is on.
+  1. Uses statfs to get the free space available on the file system.
+  2. Fills it with fill files, --jobs= of them (SFILL_JOBS by default)
+     overwritten by secure_overwrite at a time, until only SFILL_RESERVE
+     is left.
+  3. Claims the reserve as well, in preallocated files and a last one
+     written until ENOSPC, so that no free block is left unwritten.
+  4. Truncates and closes the fill files, which gives the space back.
+  Returns -1 if the space could not be filled.
+ */
+int sfill(const char *mount_point, int level) {
   struct statfs st;
-  if (statfs("/", &st) != 0) {
+  if (statfs(mount_point, &st) != 0) {
     perror("statfs");
-    exit(EXIT_FAILURE);
+    return -1;
   }
 
-  off_t free_space = st.f_bavail * st.f_bsize;
-  secure_overwrite(fd, free_space, passes);
+  // Few enough files to keep them all open, however big the file system
+  off_t free_space = fill_free_space(&st);
+  fill.dir = mount_point;
+  fill.reserve = SFILL_RESERVE;
+  fill.passes = level == 0 ? 38 : (level == 1 ? 2 : 1);
+  fill.file_size = free_space / SFILL_FILES > SFILL_FILE_SIZE ? free_space / SFILL_FILES / DIRECT_ALIGN * DIRECT_ALIGN
+                                                               : SFILL_FILE_SIZE;
 
-  close(fd);
+  int workers = jobs ? jobs : SFILL_JOBS;
+  pthread_t threads[MAX_JOBS];
+  int started = 0;
+  while (started < workers - 1 && pthread_create(&threads[started], NULL, sfill_worker, NULL) == 0) {
+    started++;
+  }
+  sfill_worker(NULL);
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  // Only the reserve is left, so the last files are claimed one at a time
+  if (!fill.failed) {
+    fill.reserve = 0;
+    atomic_store(&fill.full, 0);
+    sfill_worker(NULL);
+  }
+  if (!fill.failed) {
+    fill_last_file();
+  }
+
+  for (int i = 0; i < fill.count; i++) {
+    if (ftruncate(fill.fds[i], 0) != 0) {
+      perror("ftruncate");
+    }
+    close(fill.fds[i]);
+  }
+  return fill.failed ? -1 : 0;
 }
 
 /*
   Securely overwrite and clean the swap filesystem.
   1. Uses swapoff to disable the swap space.
   2. Uses open to get a file descriptor for the swap partition.
-  3. Uses fstat to get the size of the swap partition.
-  4. Calls secure_overwrite to overwrite the swap space.
-  5. Uses swapon to re-enable the swap space.
+  3. Uses target_size to get the size of the swap partition, and keeps
+     its first page: the swap header, which holds no swapped data.
+  4. Erases the device itself with --offload=, or calls secure_overwrite
+     to overwrite the swap space, and reports which method was used.
+  5. Writes the header back and uses swapon to re-enable the swap space.
  */
 void sswap(const char *swap_partition, int level) {
   if (swapoff(swap_partition) != 0) {
@@ -167,21 +875,54 @@ void sswap(const char *swap_partition, int level) {
     exit(EXIT_FAILURE);
   }
 
-  int fd = open(swap_partition, O_WRONLY);
+  int fd = open_target(swap_partition);
   if (fd < 0) {
     perror("open");
     exit(EXIT_FAILURE);
   }
 
-  struct stat st;
-  if (fstat(fd, &st) != 0) {
-    perror("fstat");
+  off_t size;
+  if (target_size(fd, &size) != 0) {
+    report_failure(swap_partition);
     exit(EXIT_FAILURE);
   }
 
-  int passes = level == 0 ? 38 : (level == 1 ? 2 : 1);
-  secure_overwrite(fd, st.st_size, passes);
+  long page = sysconf(_SC_PAGESIZE);
+  char *header;
+  int in = open(swap_partition, O_RDONLY);
+  if (in < 0 || posix_memalign((void **)&header, page, page) != 0 || pread(in, header, page, 0) != page) {
+    perror("swap header");
+    exit(EXIT_FAILURE);
+  }
+  close(in);
+
+  // The device erases itself with --offload=, if it can
+  double start = monotonic_seconds();
+  const char *method = offload == OFFLOAD_NONE ? NULL : offload_erase(fd, size);
+  if (!method && (offload == OFFLOAD_SECDISCARD || offload == OFFLOAD_ZEROOUT || failed_call)) {
+    report_failure(swap_partition);
+    exit(EXIT_FAILURE);
+  }
+
+  char passes_method[16];
+  if (!method) {
+    int passes = level == 0 ? 38 : (level == 1 ? 2 : 1);
+    Range all = {0, size};
+    if (secure_overwrite(fd, swap_partition, &all, 1, passes) != 0) {
+      report_failure(swap_partition);
+      exit(EXIT_FAILURE);
+    }
+    int patterns[38];
+    snprintf(passes_method, sizeof(passes_method), "%d passes", pass_patterns(passes, patterns));
+    method = passes_method;
+  }
+  report_method(swap_partition, method, size, monotonic_seconds() - start);
 
+  if (pwrite(fd, header, page, 0) != page || sync_target(fd) != 0) {
+    perror("swap header");
+    exit(EXIT_FAILURE);
+  }
+  free(header);
   close(fd);
 
   if (swapon(swap_partition, 0) != 0) {
@@ -193,115 +934,1330 @@ void sswap(const char *swap_partition, int level) {
 /*
   Securely overwrites the unused memory (RAM).
   1. Uses open to get a file descriptor for /dev/mem.
-  2. Uses fstat to get the size of the memory.
+  2. Uses target_size to get the size of the memory.
   3. Calls secure_overwrite to overwrite the memory.
  */
 void smem(int level) {
-  int fd = open("/dev/mem", O_WRONLY);
+  int fd = open_target("/dev/mem");
   if (fd < 0) {
     perror("open");
     exit(EXIT_FAILURE);
   }
 
-  struct stat st;
-  if (fstat(fd, &st) != 0) {
-    perror("fstat");
+  off_t size;
+  if (target_size(fd, &size) != 0) {
+    report_failure("/dev/mem");
     exit(EXIT_FAILURE);
   }
 
   int passes = level == 0 ? 38 : (level == 1 ? 2 : 1);
-  secure_overwrite(fd, st.st_size, passes);
+  Range all = {0, size};
+  if (secure_overwrite(fd, "/dev/mem", &all, 1, passes) != 0) {
+    report_failure("/dev/mem");
+    exit(EXIT_FAILURE);
+  }
 
   close(fd);
 }
 
 /*
-  Overwrites a file descriptor with a specified number of passes.
+  Overwrites count ranges of a file descriptor with a specified number of passes.
   Different overwrite patterns based on the number of passes:
   - One pass with 0xFF, one pass with random data for low security.
   - One pass with 0xFF, five passes with random data for medium security.
   - 38 passes (one with 0xFF, five random, 27 special values, five random) for high security.
+  Passes are written from queue_depth page-aligned buffers of at most
+  chunk_size bytes, so memory use does not depend on the size of the target.
+  Every pass writes the same ranges again, at their own offsets with
+  pwrite, so the target never grows. The disk cache is flushed after
+  every pass, or only after the last one with SYNC_END and O_DIRECT;
+  either way the data is on the disk before srm truncates the file.
+  See write_interleaved for --interleave.
  */
-void secure_overwrite(int fd, off_t size, int passes) {
-  char *buffer = malloc(size);
-  if (!buffer) {
-    perror("malloc");
-    exit(EXIT_FAILURE);
+int secure_overwrite(int fd, const char *name, const Range *ranges, int count, int passes) {
+  off_t size = 0;
+  for (int i = 0; i < count; i++) {
+    size += ranges[i].length;
+  }
+  if (buffers_alloc(size) != 0) {
+    return -1;
+  }
+
+  int patterns[38];
+  int pattern_count = pass_patterns(passes, patterns);
+  atomic_fetch_add(&bytes_planned, size * pattern_count);
+
+  if (interleave) {
+    int result = write_interleaved(fd, name, ranges, count, patterns, pattern_count, size);
+    buffers_free();
+    return result;
+  }
+
+  // A pass through the page cache would only leave the last pattern, see SYNC_END
+  int sync_each = sync_policy == SYNC_PASS || (sync_policy == SYNC_END && !bypasses_cache(fd, ranges, count));
+
+  // Every pass is timed for report_pass, with the time spent flushing apart
+  int result = 0;
+  for (int i = 0; i < pattern_count && result == 0; i++) {
+    double start = monotonic_seconds(), synced = thread_sync_seconds;
+    result = write_pass(fd, ranges, count, patterns[i]);
+    if (result == 0 && (sync_each || i == pattern_count - 1)) {
+      result = sync_target(fd);
+    }
+    if (result == 0) {
+      report_pass(name, i + 1, pattern_count, patterns[i], size, monotonic_seconds() - start,
+                  thread_sync_seconds - synced);
+    }
+  }
+
+  buffers_free();
+  return result;
+}
+
+/*
+  The passes of --interleave: the ranges are cut into slices ending on
+  window boundaries and every pattern is written over a slice, with a
+  flush as a barrier after each, before moving to the next slice. The
+  flush keeps the device from merging the patterns of a slice in its
+  cache, so each of them reaches the medium. The passes are reported
+  at the end, with their time summed over the slices.
+ */
+int write_interleaved(int fd, const char *name, const Range *ranges, int count,
+                      const int *patterns, int pattern_count, off_t size) {
+  off_t window = sync_policy == SYNC_EVERY ? (off_t)sync_every : SYNC_WINDOW;
+  double seconds[38] = {0}, synced[38] = {0};
+  int result = 0;
+  for (int i = 0; i < count && result == 0; i++) {
+    for (off_t from = ranges[i].offset, to = from + ranges[i].length; from < to && result == 0;) {
+      off_t end = (from / window + 1) * window;
+      Range slice = {from, (end < to ? end : to) - from};
+      for (int j = 0; j < pattern_count && result == 0; j++) {
+        double start = monotonic_seconds(), sync = thread_sync_seconds;
+        if ((result = write_pass(fd, &slice, 1, patterns[j])) == 0) {
+          result = sync_target(fd);
+        }
+        seconds[j] += monotonic_seconds() - start;
+        synced[j] += thread_sync_seconds - sync;
+      }
+      from += slice.length;
+    }
+  }
+
+  for (int j = 0; j < pattern_count && result == 0; j++) {
+    report_pass(name, j + 1, pattern_count, patterns[j], size, seconds[j], synced[j]);
+  }
+  return result;
+}
+
+/*
+  The buffers of the passes over size bytes in this thread: queue_depth
+  of them, page-aligned, of at most chunk_size bytes each.
+ */
+int buffers_alloc(off_t size) {
+  long page = sysconf(_SC_PAGESIZE);
+  buffer_length = (chunk_size + page - 1) / page * page;
+  if ((off_t)buffer_length > size) {
+    buffer_length = size > 0 ? (size_t)((size + page - 1) / page * page) : (size_t)page;
+  }
+
+  for (int i = 0; i < queue_depth; i++) {
+    if ((errno = posix_memalign((void **)&buffers[i].data, page, buffer_length)) != 0) {
+      failure("posix_memalign");
+      while (i--) {
+        free(buffers[i].data);
+      }
+      return -1;
+    }
+    buffers[i].length = buffer_length;
+    buffers[i].pattern = -1;
+  }
+  return 0;
+}
+
+void buffers_free(void) {
+  for (int i = 0; i < queue_depth; i++) {
+    free(buffers[i].data);
   }
+}
 
+// The patterns of the passes of a security level, returns how many there are
+int pass_patterns(int passes, int patterns[38]) {
   // Different overwrite patterns based on the number of passes
+  int pattern_count = 0;
   if (passes == 1) {
     // One pass with 0xFF, one pass with random data
-    memset(buffer, 0xFF, size);
-    if (write(fd, buffer, size) != size) {
-      perror("write");
-      exit(EXIT_FAILURE);
-    }
-    memset(buffer, rand(), size);
-    if (write(fd, buffer, size) != size) {
-      perror("write");
-      exit(EXIT_FAILURE);
-    }
+    patterns[pattern_count++] = 0xFF;
+    patterns[pattern_count++] = PATTERN_RANDOM;
   } else if (passes == 2) {
     // One pass with 0xFF, five passes with random data
-    memset(buffer, 0xFF, size);
-    if (write(fd, buffer, size) != size) {
-      perror("write");
-      exit(EXIT_FAILURE);
-    }
+    patterns[pattern_count++] = 0xFF;
     for (int i = 0; i < 5; i++) {
-      memset(buffer, rand(), size);
-      if (write(fd, buffer, size) != size) {
-        perror("write");
-        exit(EXIT_FAILURE);
-      }
+      patterns[pattern_count++] = PATTERN_RANDOM;
     }
   } else {
     // 38 passes: one pass with 0xFF, five random passes, 27 special value passes, five random passes
-    for (int i = 0; i < passes; i++) {
+    for (int i = 0; i < passes && i < 38; i++) {
       if (i == 0) {
-        memset(buffer, 0xFF, size);
+        patterns[pattern_count++] = 0xFF;
       } else if (i < 6) {
-        memset(buffer, rand(), size);
+        patterns[pattern_count++] = PATTERN_RANDOM;
       } else {
         // Overwrite with special values for maximum security
-        memset(buffer, i, size);
+        patterns[pattern_count++] = i;
       }
-      if (write(fd, buffer, size) != size) {
-        perror("write");
-        exit(EXIT_FAILURE);
-      }
-      fsync(fd);
     }
   }
-
-  free(buffer);
+  return pattern_count;
 }
 
 /*
-  Truncates a file to zero size.
-  Renames the file to an unknown name using mkstemp.
+  Opens a file for writing, with O_DIRECT unless --no-direct was given,
+  so that the passes do not fill the page cache. Files that don't support
+  O_DIRECT are opened without it.
  */
-void truncate_and_rename(const char *filepath) {
-  if (truncate(filepath, 0) != 0) {
-    perror("truncate");
-    exit(EXIT_FAILURE);
+int open_target(const char *path) {
+  int fd = -1;
+  if (use_direct) {
+    fd = open(path, O_WRONLY | O_DIRECT);
   }
-
-  char new_name[256];
-  snprintf(new_name, sizeof(new_name), "%sXXXXXX", filepath);
-  int fd = mkstemp(new_name);
   if (fd < 0) {
-    perror("mkstemp");
-    exit(EXIT_FAILURE);
-  }
-
-  if (rename(new_name, filepath) != 0) {
-    perror("rename");
-    exit(EXIT_FAILURE);
+    fd = open(path, O_WRONLY);
   }
+  return fd;
+}
 
+/*
+  The size of what fd refers to. fstat has it for regular files only:
+  a block device is sized with BLKGETSIZE64 instead. Other devices,
+  /dev/mem among them, keep the 0 of fstat: physical memory does not
+  run in one piece from address 0, and writing it would hit the kernel.
+ */
+int target_size(int fd, off_t *size) {
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    return failure("fstat");
+  }
+  *size = st.st_size;
+  if (S_ISBLK(st.st_mode)) {
+    uint64_t bytes;
+    if (ioctl(fd, BLKGETSIZE64, &bytes) != 0) {
+      return failure("BLKGETSIZE64");
+    }
+    *size = bytes;
+  }
+  return 0;
+}
+
+/*
+  The alignment of the O_DIRECT writes to fd: DIRECT_ALIGN, or the
+  physical block size of a block device if that is larger, so that no
+  write makes the device read-modify-write a block.
+ */
+static off_t target_align(int fd) {
+  struct stat st;
+  unsigned int block;
+  if (fstat(fd, &st) == 0 && S_ISBLK(st.st_mode) && ioctl(fd, BLKPBSZGET, &block) == 0 && block > DIRECT_ALIGN) {
+    return block;
+  }
+  return DIRECT_ALIGN;
+}
+
+/*
+  Whether every pass over the ranges of fd bypasses the page cache: fd
+  is open with O_DIRECT and no range has an unaligned edge, which
+  write_pass would write through the cache. SYNC_END is only safe then.
+ */
+int bypasses_cache(int fd, const Range *ranges, int count) {
+  if (!(fcntl(fd, F_GETFL) & O_DIRECT)) {
+    return 0;
+  }
+  off_t align = target_align(fd);
+  for (int i = 0; i < count; i++) {
+    if (ranges[i].offset % align || ranges[i].length % align) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+  Erases [0, size) of the block device fd with the device's own command
+  for --offload=, in seconds instead of hours of passes:
+  - BLKSECDISCARD discards the blocks and every copy the device's
+    remapping has left behind (eMMC and some SSDs);
+  - BLKZEROOUT has the device write zeros, with WRITE ZEROES where it
+    supports it.
+  Returns the name of the method used. Returns NULL with failed_call
+  unset if the device supports neither method and OFFLOAD_AUTO falls
+  back to the passes, or NULL after failure().
+ */
+const char *offload_erase(int fd, off_t size) {
+  failed_call = NULL;
+  uint64_t range[2] = {0, size};
+  if (offload == OFFLOAD_AUTO || offload == OFFLOAD_SECDISCARD) {
+    if (ioctl(fd, BLKSECDISCARD, range) == 0) {
+      return sync_target(fd) == 0 ? "BLKSECDISCARD" : NULL;
+    }
+    if (offload == OFFLOAD_SECDISCARD || (errno != EOPNOTSUPP && errno != ENOTTY && errno != EINVAL)) {
+      failure("BLKSECDISCARD");
+      return NULL;
+    }
+  }
+  if (ioctl(fd, BLKZEROOUT, range) == 0) {
+    return sync_target(fd) == 0 ? "BLKZEROOUT" : NULL;
+  }
+  if (offload == OFFLOAD_ZEROOUT || (errno != EOPNOTSUPP && errno != ENOTTY && errno != EINVAL)) {
+    failure("BLKZEROOUT");
+  }
+  return NULL;
+}
+
+/*
+  Prints how a target was erased, for audits: the method (the name of
+  the ioctl, or the number of passes), the size and the time taken. With
+  --progress=json this is a "method" event on stderr.
+ */
+void report_method(const char *name, const char *method, off_t bytes, double seconds) {
+  if (progress == PROGRESS_JSON) {
+    flockfile(stderr);
+    fprintf(stderr, "{\"event\":\"method\",\"target\":");
+    json_string(stderr, name);
+    fprintf(stderr, ",\"method\":");
+    json_string(stderr, method);
+    fprintf(stderr, ",\"bytes\":%lld,\"seconds\":%.3f}\n", (long long)bytes, seconds);
+    funlockfile(stderr);
+  }
+  char size[16];
+  format_size(bytes, size, sizeof(size));
+  printf("%s: erased %s with %s in %.1fs\n", name, size, method, seconds);
+}
+
+// Appends [from, to) to a growing list of ranges, joined to the last one if they touch
+static int add_range(Range **ranges, int *count, int *capacity, off_t from, off_t to) {
+  if (*count && (*ranges)[*count - 1].offset + (*ranges)[*count - 1].length == from) {
+    (*ranges)[*count - 1].length += to - from;
+    return 0;
+  }
+  if (*count == *capacity) {
+    Range *grown = realloc(*ranges, 2 * *capacity * sizeof(Range));
+    if (!grown) {
+      return failure("malloc");
+    }
+    *ranges = grown;
+    *capacity *= 2;
+  }
+  (*ranges)[(*count)++] = (Range){from, to - from};
+  return 0;
+}
+
+#define FIEMAP_BATCH 256
+
+/*
+  Finds the allocated ranges of the first size bytes of a file with
+  FIEMAP, so holes are skipped. Preallocated (unwritten) extents are
+  kept: they read back as zeros, but their blocks may still hold old
+  data. File systems without FIEMAP fall back to SEEK_DATA / SEEK_HOLE,
+  which is the whole file where that is not supported either.
+  Returns the number of ranges in the malloc'ed *ranges, or -1 after
+  failure().
+ */
+int file_extents(int fd, off_t size, Range **ranges) {
+  int count = 0, capacity = 16;
+  *ranges = malloc(capacity * sizeof(Range));
+  struct fiemap *map = malloc(sizeof(struct fiemap) + FIEMAP_BATCH * sizeof(struct fiemap_extent));
+  if (!*ranges || !map) {
+    free(*ranges);
+    free(map);
+    errno = ENOMEM;
+    return failure("malloc");
+  }
+
+  // FIEMAP_FLAG_SYNC writes back delayed allocations first, so they have blocks to report
+  int mapped = 1, last = 0, result = 0;
+  for (off_t start = 0; !last && start < size && result == 0;) {
+    memset(map, 0, sizeof(*map));
+    map->fm_start = start;
+    map->fm_length = size - start;
+    map->fm_flags = start == 0 ? FIEMAP_FLAG_SYNC : 0;
+    map->fm_extent_count = FIEMAP_BATCH;
+    if (ioctl(fd, FS_IOC_FIEMAP, map) != 0) {
+      mapped = 0;
+      break;
+    }
+    if (!map->fm_mapped_extents) {
+      break;
+    }
+    for (unsigned i = 0; i < map->fm_mapped_extents && result == 0; i++) {
+      struct fiemap_extent *extent = &map->fm_extents[i];
+      off_t from = extent->fe_logical, to = from + extent->fe_length;
+      if (from < size) {
+        result = add_range(ranges, &count, &capacity, from, to < size ? to : size);
+      }
+      last = extent->fe_flags & FIEMAP_EXTENT_LAST;
+      start = to;
+    }
+  }
+
+  if (!mapped) {
+    count = 0;
+    off_t data = lseek(fd, 0, SEEK_DATA);
+    if (data < 0 && errno != ENXIO) {
+      // No SEEK_DATA either: every byte is data
+      result = size > 0 ? add_range(ranges, &count, &capacity, 0, size) : 0;
+      data = size;
+    }
+    while (data >= 0 && data < size && result == 0) {
+      off_t hole = lseek(fd, data, SEEK_HOLE);
+      if (hole < 0 || hole > size) {
+        hole = size;
+      }
+      result = add_range(ranges, &count, &capacity, data, hole);
+      data = hole < size ? lseek(fd, hole, SEEK_DATA) : size;
+    }
+  }
+
+  free(map);
+  if (result != 0) {
+    free(*ranges);
+    return -1;
+  }
+  return count;
+}
+
+// Adds the time since start to the time spent flushing
+static void count_sync(double start) {
+  double seconds = monotonic_seconds() - start;
+  thread_sync_seconds += seconds;
+  atomic_fetch_add(&sync_nanos, (long long)(seconds * 1e9));
+}
+
+/*
+  Flushes the data of fd to the disk; the passes don't change the size
+  of the target, so fdatasync is enough. Character devices such as
+  /dev/mem can't be flushed and are skipped.
+ */
+int sync_target(int fd) {
+  double start = monotonic_seconds();
+  int result = fdatasync(fd) != 0 && errno != EINVAL && errno != EROFS ? failure("fdatasync") : 0;
+  count_sync(start);
+  return result;
+}
+
+/*
+  Starts write-back of the window [offset, offset + window) that was
+  just written, then waits for the window before it. Sets *window to 0
+  if the target doesn't support sync_file_range.
+ */
+static int write_behind(int fd, off_t offset, off_t *window) {
+  if (sync_file_range(fd, offset, *window, SYNC_FILE_RANGE_WRITE) != 0) {
+    if (errno == EINVAL || errno == ESPIPE) {
+      *window = 0;
+      return 0;
+    }
+    return failure("sync_file_range");
+  }
+  double start = monotonic_seconds();
+  int result = 0;
+  if (offset >= *window && sync_file_range(fd, offset - *window, *window, SYNC_FILE_RANGE_WAIT_BEFORE |
+                                           SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) != 0) {
+    result = failure("sync_file_range");
+  }
+  count_sync(start);
+  return result;
+}
+
+// Turns O_DIRECT on or off for fd, returns 1 if that changed anything
+static int set_direct(int fd, int on) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags < 0 || !(flags & O_DIRECT) == !on) {
+    return 0;
+  }
+  return fcntl(fd, F_SETFL, on ? flags | O_DIRECT : flags & ~O_DIRECT) == 0;
+}
+
+/*
+  Random passes are ChaCha20 keystream, keyed once per run from
+  getrandom(). Generator threads, started when the first chunk-sized
+  random write comes along, keep a pool of buffers filled ahead of the
+  writers, which take one per chunk with random_get() and give it back
+  with random_put() once it is written, so random passes run as fast as
+  the constant ones. Smaller writes, and writers that find no buffer
+  ready, make their keystream in their own buffer with random_fill().
+  Every fill takes its own range of the block counter, so no keystream
+  is ever written twice.
+ */
+#define RANDOM_THREADS 4
+#define RANDOM_BUFFERS (MAX_QUEUE_DEPTH + 2 * RANDOM_THREADS)
+
+typedef uint32_t u32x8 __attribute__((vector_size(32)));
+
+// The block function is also built for AVX2 and picked at load time where supported
+#if defined(__x86_64__) && defined(__linux__)
+#define CHACHA20_TARGETS __attribute__((target_clones("avx2", "default")))
+#else
+#define CHACHA20_TARGETS
+#endif
+
+static struct {
+  uint32_t state[16];
+  _Atomic uint64_t counter;
+  size_t length;
+  char *empty[RANDOM_BUFFERS], *full[RANDOM_BUFFERS];
+  int count, threads, empty_count, full_count, stopping;
+  pthread_mutex_t lock;
+  pthread_cond_t emptied;
+  pthread_once_t once;
+  pthread_t thread[RANDOM_THREADS];
+} generator = {.lock = PTHREAD_MUTEX_INITIALIZER, .emptied = PTHREAD_COND_INITIALIZER,
+               .once = PTHREAD_ONCE_INIT};
+
+#define ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define QUARTER_ROUND(a, b, c, d) \
+  a += b; d ^= a; d = ROTL(d, 16); \
+  c += d; b ^= c; b = ROTL(b, 12); \
+  a += b; d ^= a; d = ROTL(d, 8); \
+  c += d; b ^= c; b = ROTL(b, 7)
+
+/*
+  Writes the 8 blocks (512 bytes) of keystream from block counter on to
+  out. The blocks are computed side by side, one per vector lane. Words 12
+  and 13 of the state hold the 64-bit block counter.
+ */
+CHACHA20_TARGETS
+static void chacha20_blocks(const uint32_t state[16], uint64_t counter, uint8_t *out) {
+  u32x8 x[16], input[16];
+  for (int i = 0; i < 16; i++) {
+    input[i] = (u32x8){0} + state[i];
+  }
+  for (int lane = 0; lane < 8; lane++) {
+    input[12][lane] = (uint32_t)(counter + lane);
+    input[13][lane] = (uint32_t)((counter + lane) >> 32);
+  }
+  memcpy(x, input, sizeof(x));
+
+  for (int round = 0; round < 10; round++) {
+    QUARTER_ROUND(x[0], x[4], x[8], x[12]);
+    QUARTER_ROUND(x[1], x[5], x[9], x[13]);
+    QUARTER_ROUND(x[2], x[6], x[10], x[14]);
+    QUARTER_ROUND(x[3], x[7], x[11], x[15]);
+    QUARTER_ROUND(x[0], x[5], x[10], x[15]);
+    QUARTER_ROUND(x[1], x[6], x[11], x[12]);
+    QUARTER_ROUND(x[2], x[7], x[8], x[13]);
+    QUARTER_ROUND(x[3], x[4], x[9], x[14]);
+  }
+
+  for (int i = 0; i < 16; i++) {
+    x[i] += input[i];
+  }
+  for (int lane = 0; lane < 8; lane++) {
+    for (int i = 0; i < 16; i++) {
+      uint32_t word = x[i][lane];
+      uint8_t *p = out + lane * 64 + i * 4;
+      p[0] = word;
+      p[1] = word >> 8;
+      p[2] = word >> 16;
+      p[3] = word >> 24;
+    }
+  }
+}
+
+/*
+  Fills length bytes of data with keystream, rounded up to whole 512 byte
+  steps of chacha20_blocks; buffers are a multiple of the page size, so
+  they have room for it.
+ */
+static void random_fill(char *data, size_t length) {
+  uint64_t counter = atomic_fetch_add(&generator.counter, (length + 511) / 512 * 8);
+  for (size_t i = 0; i < length; i += 512, counter += 8) {
+    chacha20_blocks(generator.state, counter, (uint8_t *)data + i);
+  }
+}
+
+static void *random_worker(void *unused) {
+  (void)unused;
+  pthread_mutex_lock(&generator.lock);
+  while (!generator.stopping) {
+    if (!generator.empty_count) {
+      pthread_cond_wait(&generator.emptied, &generator.lock);
+      continue;
+    }
+    char *data = generator.empty[--generator.empty_count];
+    pthread_mutex_unlock(&generator.lock);
+
+    random_fill(data, generator.length);
+
+    pthread_mutex_lock(&generator.lock);
+    generator.full[generator.full_count++] = data;
+  }
+  pthread_mutex_unlock(&generator.lock);
+  return NULL;
+}
+
+// Allocates the pool and starts the generator threads, once
+static void random_threads_start(void) {
+  // About half of the cores, which keeps up with the writers on fast devices
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  int threads = cores / 2 < 1 ? 1 : cores / 2 > RANDOM_THREADS ? RANDOM_THREADS : cores / 2;
+
+  long page = sysconf(_SC_PAGESIZE);
+  generator.count = queue_depth + 2 * threads;
+  for (int i = 0; i < generator.count; i++) {
+    if ((errno = posix_memalign((void **)&generator.empty[i], page, generator.length)) != 0) {
+      perror("posix_memalign");
+      exit(EXIT_FAILURE);
+    }
+    generator.empty_count++;
+  }
+  for (; generator.threads < threads; generator.threads++) {
+    if ((errno = pthread_create(&generator.thread[generator.threads], NULL, random_worker, NULL)) != 0) {
+      perror("pthread_create");
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+void random_start(void) {
+  static const char sigma[16] = "expand 32-byte k";
+  memcpy(generator.state, sigma, sizeof(sigma));
+  // The key, then a random nonce in words 14 and 15; the counter starts at 0
+  if (getrandom(&generator.state[4], 8 * sizeof(uint32_t), 0) != 8 * sizeof(uint32_t) ||
+      getrandom(&generator.state[14], 2 * sizeof(uint32_t), 0) != 2 * sizeof(uint32_t)) {
+    perror("getrandom");
+    exit(EXIT_FAILURE);
+  }
+  generator.counter = 0;
+
+  // The pool buffers are as long as the longest chunk
+  long page = sysconf(_SC_PAGESIZE);
+  generator.length = (chunk_size + page - 1) / page * page;
+}
+
+void random_stop(void) {
+  pthread_mutex_lock(&generator.lock);
+  generator.stopping = 1;
+  pthread_cond_broadcast(&generator.emptied);
+  pthread_mutex_unlock(&generator.lock);
+  for (int i = 0; i < generator.threads; i++) {
+    pthread_join(generator.thread[i], NULL);
+  }
+
+  for (int i = 0; i < generator.empty_count; i++) {
+    free(generator.empty[i]);
+  }
+  for (int i = 0; i < generator.full_count; i++) {
+    free(generator.full[i]);
+  }
+  explicit_bzero(generator.state, sizeof(generator.state));
+  generator.counter = 0;
+}
+
+// A buffer of fresh keystream from the pool, or NULL if none is ready
+static char *random_get(void) {
+  pthread_once(&generator.once, random_threads_start);
+  pthread_mutex_lock(&generator.lock);
+  char *data = generator.full_count ? generator.full[--generator.full_count] : NULL;
+  pthread_mutex_unlock(&generator.lock);
+  return data;
+}
+
+static void random_put(char *data) {
+  pthread_mutex_lock(&generator.lock);
+  generator.empty[generator.empty_count++] = data;
+  pthread_cond_signal(&generator.emptied);
+  pthread_mutex_unlock(&generator.lock);
+}
+
+/*
+  The length bytes to write for pattern: keystream for random passes,
+  otherwise buffer, filled with the pattern byte the first time.
+  release_data gives keystream from the pool back once it is written.
+ */
+static char *take_data(Buffer *buffer, int pattern, size_t length) {
+  if (pattern == PATTERN_RANDOM) {
+    char *data = length * 2 >= generator.length ? random_get() : NULL;
+    if (data) {
+      return data;
+    }
+    random_fill(buffer->data, length);
+    buffer->pattern = -1;
+    return buffer->data;
+  }
+  if (buffer->pattern != pattern) {
+    memset(buffer->data, pattern, buffer->length);
+    buffer->pattern = pattern;
+  }
+  return buffer->data;
+}
+
+static void release_data(Buffer *buffer, char *data) {
+  if (data != buffer->data) {
+    random_put(data);
+  }
+}
+
+/*
+  Writes length bytes of data at offset. A short write continues where it
+  stopped, and a write that makes no progress is an error. If the file
+  rejects an O_DIRECT write, O_DIRECT is dropped and the write retried.
+  Every write is counted in bytes_written as it completes, for --progress.
+ */
+static int write_range(int fd, const char *data, off_t offset, size_t length) {
+  size_t done = 0;
+  while (done < length) {
+    ssize_t written = pwrite(fd, data + done, length - done, offset + done);
+    if (written < 0 && (errno == EINTR || (errno == EINVAL && set_direct(fd, 0)))) {
+      continue;
+    }
+    if (written <= 0) {
+      if (written == 0) {
+        errno = ENOSPC;
+      }
+      return failure("pwrite");
+    }
+    done += written;
+    atomic_fetch_add(&bytes_written, written);
+  }
+  return 0;
+}
+
+/*
+  The chunks of a list of ranges, in order: each range is cut into
+  pieces of at most chunk bytes, so the engines keep queue_depth writes
+  in flight across many small extents as well as in one big range.
+ */
+typedef struct {
+  const Range *ranges;
+  int count, index;
+  off_t done;
+  size_t chunk;
+} Chunks;
+
+static int next_chunk(Chunks *chunks, off_t *offset, size_t *length) {
+  while (chunks->index < chunks->count && chunks->done == chunks->ranges[chunks->index].length) {
+    chunks->index++;
+    chunks->done = 0;
+  }
+  if (chunks->index == chunks->count) {
+    return 0;
+  }
+  const Range *range = &chunks->ranges[chunks->index];
+  off_t left = range->length - chunks->done;
+  *offset = range->offset + chunks->done;
+  *length = left < (off_t)chunks->chunk ? (size_t)left : chunks->chunk;
+  chunks->done += *length;
+  return 1;
+}
+
+// Writes the ranges of fd one chunk at a time
+static int write_sync(int fd, const Range *ranges, int count, int pattern) {
+  Chunks chunks = {ranges, count, 0, 0, buffer_length};
+  off_t offset;
+  size_t length;
+  while (next_chunk(&chunks, &offset, &length)) {
+    char *data = take_data(&buffers[0], pattern, length);
+    int result = write_range(fd, data, offset, length);
+    release_data(&buffers[0], data);
+    if (result != 0) {
+      return result;
+    }
+  }
+  return 0;
+}
+
+/*
+  Threaded engine: queue_depth threads take the chunks of the ranges in
+  turn, each writing from its own buffer. The first error stops them all
+  and is handed back to the thread running the pass.
+ */
+typedef struct {
+  int fd;
+  int pattern;
+  Chunks chunks;
+  pthread_mutex_t lock;
+  atomic_int failed;
+  const char *failed_call;
+  int failed_errno;
+} ThreadPass;
+
+typedef struct {
+  ThreadPass *pass;
+  Buffer *buffer;
+} ThreadWorker;
+
+static void *write_worker(void *arg) {
+  ThreadWorker *worker = arg;
+  ThreadPass *pass = worker->pass;
+  off_t offset;
+  size_t length;
+  while (!atomic_load(&pass->failed)) {
+    pthread_mutex_lock(&pass->lock);
+    int more = next_chunk(&pass->chunks, &offset, &length);
+    pthread_mutex_unlock(&pass->lock);
+    if (!more) {
+      break;
+    }
+    char *data = take_data(worker->buffer, pass->pattern, length);
+    int result = write_range(pass->fd, data, offset, length);
+    release_data(worker->buffer, data);
+    if (result != 0 && !atomic_exchange(&pass->failed, 1)) {
+      pass->failed_call = failed_call;
+      pass->failed_errno = failed_errno;
+    }
+  }
+  return NULL;
+}
+
+static int write_threads(int fd, const Range *ranges, int count, int pattern) {
+  ThreadPass pass = {fd, pattern, {ranges, count, 0, 0, buffer_length}, PTHREAD_MUTEX_INITIALIZER, 0, NULL, 0};
+  ThreadWorker workers[MAX_QUEUE_DEPTH];
+  pthread_t threads[MAX_QUEUE_DEPTH];
+  int started = 0;
+  for (; started < queue_depth; started++) {
+    workers[started] = (ThreadWorker){&pass, &buffers[started]};
+    if ((errno = pthread_create(&threads[started], NULL, write_worker, &workers[started])) != 0) {
+      break;
+    }
+  }
+  // Without any thread the pass is written here
+  if (!started) {
+    return write_sync(fd, ranges, count, pattern);
+  }
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  if (pass.failed) {
+    failed_call = pass.failed_call;
+    failed_errno = pass.failed_errno;
+    return -1;
+  }
+  return 0;
+}
+
+#ifdef HAVE_IO_URING
+/*
+  io_uring engine: the rings are mapped once and every free buffer is
+  queued as a write; each completion queues the next chunk (or the rest
+  of a short write) until the pass is done. Set up through the raw
+  system calls, so liburing is not needed.
+ */
+typedef struct {
+  int fd;
+  unsigned *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring, *cq_ring;
+  size_t sq_size, cq_size, sqes_size;
+  unsigned pending;
+} Ring;
+
+// One ring per thread running passes, set up on its first pass
+static _Thread_local Ring ring = {.fd = -1};
+
+// Returns 0 if io_uring can't be used here (old kernel, seccomp)
+static int ring_setup() {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int fd = syscall(__NR_io_uring_setup, queue_depth, &p);
+  if (fd < 0) {
+    return 0;
+  }
+
+  ring.sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring.cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  ring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring.sq_ring = mmap(NULL, ring.sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  ring.cq_ring = mmap(NULL, ring.cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (ring.sq_ring == MAP_FAILED || ring.cq_ring == MAP_FAILED || ring.sqes == MAP_FAILED) {
+    close(fd);
+    return 0;
+  }
+
+  uint8_t *sq = ring.sq_ring, *cq = ring.cq_ring;
+  ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  ring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+  ring.cq_head = (unsigned *)(cq + p.cq_off.head);
+  ring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  ring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  ring.fd = fd;
+  return 1;
+}
+
+void ring_close(void) {
+  if (ring.fd >= 0) {
+    munmap(ring.sq_ring, ring.sq_size);
+    munmap(ring.cq_ring, ring.cq_size);
+    munmap(ring.sqes, ring.sqes_size);
+    close(ring.fd);
+    ring.fd = -1;
+  }
+}
+
+static void ring_write(int fd, const char *data, off_t offset, size_t length, unsigned slot) {
+  unsigned tail = *ring.sq_tail;
+  unsigned index = tail & *ring.sq_mask;
+  struct io_uring_sqe *sqe = &ring.sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t)data;
+  sqe->len = length;
+  sqe->off = offset;
+  sqe->user_data = slot;
+  ring.sq_array[index] = index;
+  __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring.pending++;
+}
+
+// Submits the queued writes and waits for at least one of them
+static void ring_wait() {
+  int submitted;
+  while ((submitted = syscall(__NR_io_uring_enter, ring.fd, ring.pending, 1, IORING_ENTER_GETEVENTS, NULL, 0)) < 0) {
+    if (errno != EINTR) {
+      perror("io_uring_enter");
+      exit(EXIT_FAILURE);
+    }
+  }
+  ring.pending -= submitted;
+}
+
+/*
+  After an error no more writes are queued, but the ones in flight are
+  still waited for, since they use the buffers.
+ */
+static int write_uring(int fd, const Range *ranges, int count, int pattern) {
+  struct { char *data; off_t offset; size_t length, done; } writes[MAX_QUEUE_DEPTH] = {{NULL, 0, 0, 0}};
+  Chunks chunks = {ranges, count, 0, 0, buffer_length};
+  int more = 1, busy = 0, result = 0;
+  while ((more && result == 0) || busy) {
+    for (int i = 0; i < queue_depth && more && result == 0; i++) {
+      if (writes[i].length) {
+        continue;
+      }
+      off_t offset;
+      size_t length;
+      if (!(more = next_chunk(&chunks, &offset, &length))) {
+        break;
+      }
+      writes[i].data = take_data(&buffers[i], pattern, length);
+      writes[i].offset = offset;
+      writes[i].length = length;
+      writes[i].done = 0;
+      ring_write(fd, writes[i].data, offset, length, i);
+      busy++;
+    }
+    if (!busy) {
+      break;
+    }
+
+    ring_wait();
+    unsigned head = *ring.cq_head;
+    while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe *cqe = &ring.cqes[head++ & *ring.cq_mask];
+      unsigned i = cqe->user_data;
+      int written = cqe->res;
+      if (written <= 0 && result == 0 &&
+          !(written == -EINTR || written == -EAGAIN || (written == -EINVAL && set_direct(fd, 0)))) {
+        errno = written ? -written : ENOSPC;
+        result = failure("io_uring write");
+      }
+      if (written > 0) {
+        writes[i].done += written;
+        atomic_fetch_add(&bytes_written, written);
+      }
+      if (writes[i].done < writes[i].length && result == 0) {
+        ring_write(fd, writes[i].data + writes[i].done, writes[i].offset + writes[i].done,
+                   writes[i].length - writes[i].done, i);
+      } else {
+        release_data(&buffers[i], writes[i].data);
+        writes[i].length = 0;
+        busy--;
+      }
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+  }
+  return result;
+}
+#else
+void ring_close(void) {
+}
+#endif
+
+/*
+  Writes the byte pattern over the ranges of fd with the engine chosen by
+  --io=, falling back to threads when io_uring is not available. Ranges
+  of a single chunk are not worth starting threads for and are always
+  written directly.
+ */
+static int write_engine(int fd, const Range *ranges, int count, int pattern) {
+  int single = count == 1 && ranges[0].length <= (off_t)buffer_length;
+#ifdef HAVE_IO_URING
+  if (io_engine == IO_URING && ring.fd < 0 && !ring_setup()) {
+    io_engine = IO_THREADS;
+  }
+  if (io_engine == IO_URING && !single) {
+    return write_uring(fd, ranges, count, pattern);
+  }
+#else
+  if (io_engine == IO_URING) {
+    io_engine = IO_THREADS;
+  }
+#endif
+  if (io_engine == IO_THREADS && queue_depth > 1 && !single) {
+    return write_threads(fd, ranges, count, pattern);
+  }
+  return write_sync(fd, ranges, count, pattern);
+}
+
+/*
+  Writes the byte pattern over count ranges of fd, sorted by offset, in
+  write-back windows when it goes through the page cache (see
+  sync_policy). With O_DIRECT the edges of the ranges that are not
+  aligned to DIRECT_ALIGN are written through the page cache at the end.
+ */
+int write_pass(int fd, const Range *ranges, int count, int pattern) {
+  int direct = fcntl(fd, F_GETFL) & O_DIRECT;
+  off_t align = 1, window = 0;
+  if (direct) {
+    align = target_align(fd);
+  } else if (sync_policy == SYNC_PASS) {
+    window = SYNC_WINDOW;
+  }
+  if (sync_policy == SYNC_EVERY) {
+    window = sync_every;
+  }
+
+  // The aligned parts of the ranges, cut where the windows end, and the edges
+  size_t capacity = 1;
+  for (int i = 0; i < count; i++) {
+    capacity += (window ? ranges[i].length / window : 0) + 2;
+  }
+  Range *parts = malloc(capacity * sizeof(Range));
+  Range *edges = malloc((2 * count + 1) * sizeof(Range));
+  if (!parts || !edges) {
+    free(parts);
+    free(edges);
+    errno = ENOMEM;
+    return failure("malloc");
+  }
+  int part_count = 0, edge_count = 0;
+  for (int i = 0; i < count; i++) {
+    off_t from = ranges[i].offset, to = from + ranges[i].length;
+    off_t first = (from + align - 1) / align * align, last = to / align * align;
+    if (first >= last) {
+      edges[edge_count++] = ranges[i];
+      continue;
+    }
+    if (from < first) {
+      edges[edge_count++] = (Range){from, first - from};
+    }
+    if (last < to) {
+      edges[edge_count++] = (Range){last, to - last};
+    }
+    while (first < last) {
+      off_t end = window ? (first / window + 1) * window : last;
+      end = end < last ? end : last;
+      parts[part_count++] = (Range){first, end - first};
+      first = end;
+    }
+  }
+
+  // O_DIRECT leaves nothing to write back, only the disk cache to flush
+  int result = 0;
+  for (int i = 0; i < part_count && result == 0;) {
+    int n = 1;
+    while (i + n < part_count && (!window || parts[i + n].offset / window == parts[i].offset / window)) {
+      n++;
+    }
+    result = write_engine(fd, parts + i, n, pattern);
+    if (result == 0 && window) {
+      result = direct ? sync_target(fd) : write_behind(fd, parts[i].offset / window * window, &window);
+    }
+    i += n;
+  }
+
+  if (result == 0 && edge_count) {
+    set_direct(fd, 0);
+    result = write_sync(fd, edges, edge_count, pattern);
+    if (direct) {
+      set_direct(fd, 1);
+    }
+  }
+  free(parts);
+  free(edges);
+  return result;
+}
+
+/*
+  Parses a size in bytes with an optional K, M or G suffix.
+  Returns 0 if the text is not a valid size.
+ */
+size_t parse_size(const char *text) {
+  char *end;
+  unsigned long long value = strtoull(text, &end, 10);
+  if (end == text) {
+    return 0;
+  }
+  switch (*end) {
+    case 'K': case 'k': value <<= 10; end++; break;
+    case 'M': case 'm': value <<= 20; end++; break;
+    case 'G': case 'g': value <<= 30; end++; break;
+  }
+  return *end ? 0 : value;
+}
+
+// Formats bytes like parse_size reads them, with one decimal above 1K
+void format_size(long long bytes, char *text, size_t length) {
+  static const char units[] = "KMGTPE";
+  if (bytes < 1024) {
+    snprintf(text, length, "%lld", bytes);
+    return;
+  }
+  double value = bytes / 1024.0;
+  int unit = 0;
+  while (value >= 1024 && units[unit + 1]) {
+    value /= 1024;
+    unit++;
+  }
+  snprintf(text, length, "%.1f%c", value, units[unit]);
+}
+
+double monotonic_seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void json_string(FILE *out, const char *text) {
+  fputc('"', out);
+  for (; *text; text++) {
+    unsigned char c = *text;
+    if (c == '"' || c == '\\') {
+      fprintf(out, "\\%c", c);
+    } else if (c < 0x20) {
+      fprintf(out, "\\u%04x", c);
+    } else {
+      fputc(c, out);
+    }
+  }
+  fputc('"', out);
+}
+
+// Formats a duration as h:mm:ss
+static void format_duration(double seconds, char *text, size_t length) {
+  long total = (long)seconds;
+  snprintf(text, length, "%ld:%02ld:%02ld", total / 3600, total / 60 % 60, total % 60);
+}
+
+/*
+  The reporter thread of --progress prints a status line every
+  PROGRESS_INTERVAL seconds: bytes written and planned, the rate over
+  the last interval, the ETA at that rate and the time spent flushing.
+  On a terminal the text line is rewritten in place.
+ */
+static struct {
+  int started, stopping, tty;
+  double start, last_time;
+  long long last_bytes;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t stop;
+} reporter = {.lock = PTHREAD_MUTEX_INITIALIZER, .stop = PTHREAD_COND_INITIALIZER};
+
+static void report_progress(int last) {
+  double now = monotonic_seconds();
+  long long written = bytes_written, planned = bytes_planned;
+  double rate = now > reporter.last_time ? (written - reporter.last_bytes) / (now - reporter.last_time) : 0;
+  double eta = rate > 0 && planned > written ? (planned - written) / rate : -1;
+  double sync = sync_nanos / 1e9;
+  reporter.last_time = now;
+  reporter.last_bytes = written;
+
+  flockfile(stderr);
+  if (progress == PROGRESS_JSON) {
+    fprintf(stderr, "{\"event\":\"progress\",\"elapsed\":%.3f,\"bytes\":%lld,\"planned\":%lld,\"rate\":%.0f,",
+            now - reporter.start, written, planned, rate);
+    if (eta >= 0) {
+      fprintf(stderr, "\"eta\":%.0f,", eta);
+    } else {
+      fprintf(stderr, "\"eta\":null,");
+    }
+    fprintf(stderr, "\"sync_seconds\":%.3f}\n", sync);
+  } else {
+    char done[16], total[16], speed[16], left[32] = "--";
+    format_size(written, done, sizeof(done));
+    format_size(planned, total, sizeof(total));
+    format_size((long long)rate, speed, sizeof(speed));
+    if (eta >= 0) {
+      format_duration(eta, left, sizeof(left));
+    }
+    fprintf(stderr, "%s%s of %s written, %s/s, ETA %s, sync %.1fs%s", reporter.tty ? "\r\033[K" : "",
+            done, total, speed, left, sync, reporter.tty && !last ? "" : "\n");
+  }
+  funlockfile(stderr);
+}
+
+static void *progress_worker(void *unused) {
+  (void)unused;
+  pthread_mutex_lock(&reporter.lock);
+  while (!reporter.stopping) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += PROGRESS_INTERVAL;
+    if (pthread_cond_timedwait(&reporter.stop, &reporter.lock, &until) == ETIMEDOUT) {
+      report_progress(0);
+    }
+  }
+  pthread_mutex_unlock(&reporter.lock);
+  return NULL;
+}
+
+void progress_start(void) {
+  if (progress == PROGRESS_NONE) {
+    return;
+  }
+  reporter.tty = progress == PROGRESS_TEXT && isatty(STDERR_FILENO);
+  reporter.start = reporter.last_time = monotonic_seconds();
+  reporter.started = pthread_create(&reporter.thread, NULL, progress_worker, NULL) == 0;
+}
+
+void progress_stop(void) {
+  if (!reporter.started) {
+    return;
+  }
+  pthread_mutex_lock(&reporter.lock);
+  reporter.stopping = 1;
+  pthread_cond_signal(&reporter.stop);
+  pthread_mutex_unlock(&reporter.lock);
+  pthread_join(reporter.thread, NULL);
+  reporter.started = 0;
+  // Over the whole run
+  reporter.last_time = reporter.start;
+  reporter.last_bytes = 0;
+  report_progress(1);
+}
+
+void report_pass(const char *name, int pass, int passes, int pattern, off_t bytes, double seconds, double sync) {
+  if (progress == PROGRESS_NONE) {
+    return;
+  }
+  double rate = seconds > 0 ? bytes / seconds : 0;
+  flockfile(stderr);
+  if (progress == PROGRESS_JSON) {
+    fprintf(stderr, "{\"event\":\"pass\",\"target\":");
+    json_string(stderr, name);
+    fprintf(stderr, ",\"pass\":%d,\"passes\":%d,\"pattern\":", pass, passes);
+    if (pattern == PATTERN_RANDOM) {
+      fprintf(stderr, "\"random\"");
+    } else {
+      fprintf(stderr, "%d", pattern);
+    }
+    fprintf(stderr, ",\"bytes\":%lld,\"seconds\":%.3f,\"rate\":%.0f,\"sync_seconds\":%.3f}\n",
+            (long long)bytes, seconds, rate, sync);
+  } else {
+    char size[16], speed[16], kind[8] = "random";
+    format_size(bytes, size, sizeof(size));
+    format_size((long long)rate, speed, sizeof(speed));
+    if (pattern != PATTERN_RANDOM) {
+      snprintf(kind, sizeof(kind), "0x%02X", pattern);
+    }
+    fprintf(stderr, "%s%s: pass %d/%d (%s) %s in %.1fs, %s/s, sync %.1fs\n", reporter.tty ? "\r\033[K" : "",
+            name, pass, passes, kind, size, seconds, speed, sync);
+  }
+  funlockfile(stderr);
+}
+
+/*
+  Measures the sustained write rate of the file system dir is on: one
+  random pass over a fill file of BENCH_SIZE bytes (at most half the
+  free space), flushed at the end, through the same engines as a real
+  run. The fill file has no name and nothing else is touched. Prints the
+  rate and how long the passes of the security level take per gigabyte.
+ */
+int bench(const char *dir, int level) {
+  struct statfs st;
+  if (statfs(dir, &st) != 0) {
+    perror("statfs");
+    return -1;
+  }
+  off_t size = (off_t)st.f_bavail * st.f_bsize / 2;
+  size = (size < BENCH_SIZE ? size : BENCH_SIZE) / DIRECT_ALIGN * DIRECT_ALIGN;
+  int fd = open_fill_file(dir);
+  if (fd < 0) {
+    perror("open");
+    return -1;
+  }
+  if (size < DIRECT_ALIGN || (fallocate(fd, 0, 0, size) != 0 && errno != EOPNOTSUPP)) {
+    fprintf(stderr, "%s: not enough free space for --bench\n", dir);
+    close(fd);
+    return -1;
+  }
+
+  Range all = {0, size};
+  double start = monotonic_seconds();
+  int result = buffers_alloc(size);
+  if (result == 0) {
+    if ((result = write_pass(fd, &all, 1, PATTERN_RANDOM)) == 0) {
+      result = sync_target(fd);
+    }
+    buffers_free();
+  }
+  double seconds = monotonic_seconds() - start;
+  ftruncate(fd, 0);
   close(fd);
+  if (result != 0) {
+    report_failure(dir);
+    return -1;
+  }
+
+  int patterns[38];
+  int passes = pass_patterns(level == 0 ? 38 : (level == 1 ? 2 : 1), patterns);
+  double rate = size / seconds, per_gigabyte = passes * (double)(1 << 30) / rate;
+  if (progress == PROGRESS_JSON) {
+    fprintf(stderr, "{\"event\":\"bench\",\"target\":");
+    json_string(stderr, dir);
+    fprintf(stderr, ",\"bytes\":%lld,\"seconds\":%.3f,\"rate\":%.0f,\"passes\":%d,\"seconds_per_gigabyte\":%.3f}\n",
+            (long long)size, seconds, rate, passes, per_gigabyte);
+  } else {
+    char written[16], speed[16], duration[32];
+    format_size(size, written, sizeof(written));
+    format_size((long long)rate, speed, sizeof(speed));
+    format_duration(per_gigabyte, duration, sizeof(duration));
+    fprintf(stderr, "%s: %s in %.1fs, %s/s; %d passes take about %s per G\n",
+            dir, written, seconds, speed, passes, duration);
+  }
+  return 0;
+}
+
+/*
+  Truncates a file to zero size.
+  Renames the file to an unknown name using mkstemp.
+ */
+int truncate_and_rename(const char *filepath) {
+  if (truncate(filepath, 0) != 0) {
+    return failure("truncate");
+  }
+
+  char new_name[PATH_MAX];
+  if (snprintf(new_name, sizeof(new_name), "%sXXXXXX", filepath) >= (int)sizeof(new_name)) {
+    errno = ENAMETOOLONG;
+    return failure("mkstemp");
+  }
+  int fd = mkstemp(new_name);
+  if (fd < 0) {
+    return failure("mkstemp");
+  }
+  close(fd);
+
+  if (rename(new_name, filepath) != 0) {
+    failure("rename");
+    unlink(new_name);
+    return -1;
+  }
+  return 0;
 }
 
 void handle_error(const char *message) {
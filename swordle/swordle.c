@@ -9,16 +9,22 @@
  * Author: Mitchell <mitchell@sdf.org>
  * Date: July 2024
  * 
- * Compilation: gcc -o swordle swordle.c
+ * Compilation: gcc -O2 -o swordle swordle.c -lpthread -lm
+ *              (-lpthread only where there are POSIX threads)
  * 
- * This program reads a list of words from "words.txt", selects a random word,
+ * This program loads the list of words in "words.txt" once, selects a random word,
  * and allows the player to guess the word within a set number of tries. The game
  * provides feedback on each guess using color codes to indicate whether letters
  * are correct and in the correct position.
+ *
+ * With --solve WORD it prints how its solver finds WORD instead, and with
+ * --simulate[=N] it has the solver play every word (or N random ones) with
+ * each of its strategies and prints the number of guesses they took.
  */
 
 #include <assert.h>
 #include <ctype.h>
+#include <math.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -26,6 +32,14 @@
 #include <string.h>
 #include <time.h>
 
+// The solver runs on a thread per processor where there are POSIX threads, on one elsewhere
+#if defined(__linux__) || defined(__unix__) || defined(__APPLE__)
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#define SOLVER_THREADS
+#endif
+
 #define COLOR_GREEN "\x1B[32m"
 #define COLOR_YELLOW "\x1B[33m"
 #define COLOR_WHITE "\x1B[37m"
@@ -36,7 +50,12 @@
 #define NEWLINE_STR "\n"
 #define NEWLINE_CHAR (char) '\n'
 
+#define WORDS_FILE "words.txt"
+
 #define WORD_LENGTH 5
+#define ALPHABET_SIZE 26
+// Every possible word of WORD_LENGTH letters, as a number in base ALPHABET_SIZE
+#define WORD_CODES (ALPHABET_SIZE * ALPHABET_SIZE * ALPHABET_SIZE * ALPHABET_SIZE * ALPHABET_SIZE)
 #define MAX_GUESSES 6
 #define LAST_CHARACTER WORD_LENGTH
 #define GUESS_ARRAY_SIZE (MAX_GUESSES * WORD_LENGTH)
@@ -45,6 +64,10 @@
 #define IN_WORD_WRONG_INDEX 1
 #define IN_WORD_CORRECT_INDEX 2
 
+// Feedback patterns are WORD_LENGTH digits in base 3, one of the above per letter
+#define PATTERN_COUNT 243
+#define PATTERN_SOLVED (PATTERN_COUNT - 1)
+
 #define PLAYER_WON true
 #define PLAYER_LOST false
 
@@ -67,44 +90,77 @@
 void get_input();
 void terminate(uint8_t exit_code);
 
-FILE* file_ptr;
+/*
+ * The words of WORDS_FILE, uppercase, as WORD_LENGTH-byte records with no
+ * separators: word i is word_table + i * WORD_LENGTH.
+ */
+char* word_table;
+size_t word_count = 0;
+
+/*
+ * One bit for every word code, set for the words of the word table, so that
+ * a guess is looked up in constant time (WORD_CODES / 8 bytes, about 1.5 MB).
+ */
+uint8_t* dictionary;
 
-size_t words_length = 0;
 size_t current_line = 0;
 
 char user_input[WORD_LENGTH + 1];
 char current_word[WORD_LENGTH + 1];
 char guess_list[GUESS_ARRAY_SIZE];
+uint8_t guess_patterns[MAX_GUESSES];
 
 bool game_over = false;
 
 /**
- * Check if a letter is in the current word and return its status.
+ * Score a guess against an answer, the way Wordle does: a letter in the right
+ * place is IN_WORD_CORRECT_INDEX, and the other letters of the guess are
+ * IN_WORD_WRONG_INDEX, from left to right, only as many times as the answer
+ * has that letter outside the right places.
  *
- * @param letter The letter to check.
- * @param guess_list_index The index in the guess list.
- * @return Status code indicating if the letter is in the word and its position.
+ * @param guess The guess, WORD_LENGTH uppercase letters.
+ * @param answer The answer, WORD_LENGTH uppercase letters.
+ * @return The pattern: the status of letter i is digit i, in base 3.
  */
-uint8_t check_letter_in_word(char letter, size_t guess_list_index) {
-  if (current_word[guess_list_index] == letter)
-    return IN_WORD_CORRECT_INDEX;
+uint8_t score_guess(const char* guess, const char* answer) {
+  uint8_t remaining[ALPHABET_SIZE];
+  uint8_t status[WORD_LENGTH];
+
+  for (size_t i = 0; i < WORD_LENGTH; ++i)
+    remaining[guess[i] - 'A'] = remaining[answer[i] - 'A'] = 0;
 
-  for (uint8_t i = 0; i < WORD_LENGTH; ++i) 
-    if (current_word[i] == letter)
-      return IN_WORD_WRONG_INDEX;
+  for (size_t i = 0; i < WORD_LENGTH; ++i) {
+    status[i] = guess[i] == answer[i] ? IN_WORD_CORRECT_INDEX : NOT_IN_WORD;
+    if (status[i] == NOT_IN_WORD)
+      ++remaining[answer[i] - 'A'];
+  }
 
-  return NOT_IN_WORD;
+  for (size_t i = 0; i < WORD_LENGTH; ++i)
+    if (status[i] == NOT_IN_WORD && remaining[guess[i] - 'A']) {
+      status[i] = IN_WORD_WRONG_INDEX;
+      --remaining[guess[i] - 'A'];
+    }
+
+  uint8_t pattern = 0;
+
+  for (size_t i = WORD_LENGTH; i-- > 0;)
+    pattern = pattern * 3 + status[i];
+
+  return pattern;
 }
 
 /**
- * Determine the color to print the letter based on its status.
+ * Determine the color to print a letter in from its status.
  *
- * @param letter The letter to determine the color for.
- * @param guess_list_index The index in the guess list.
+ * @param pattern The pattern of the guess the letter is in.
+ * @param letter_index The index of the letter in the guess.
  * @return The color code for the letter.
  */
-const char* determine_letter_color(char letter, size_t guess_list_index) {
-  switch (check_letter_in_word(letter, guess_list_index)) {
+const char* determine_letter_color(uint8_t pattern, size_t letter_index) {
+  for (size_t i = 0; i < letter_index; ++i)
+    pattern /= 3;
+
+  switch (pattern % 3) {
   case IN_WORD_CORRECT_INDEX:
     return COLOR_GREEN;
   case IN_WORD_WRONG_INDEX:
@@ -125,32 +181,102 @@ void print_letter(char letter, const char* color) {
 }
 
 /**
- * Assign a random word from the "words.txt" file to the current word.
+ * Load the words of the "words.txt" file into the word table, with a single
+ * read. Lines that are not WORD_LENGTH letters are skipped.
  */
-void assign_random_word() {
- start_label:;
-  char ch;
+void load_words() {
+  FILE* file_ptr = fopen(WORDS_FILE, "rb");
+  assert_print(file_ptr, "Unable to find or open words.txt");
 
-  if (!file_ptr) {
-    file_ptr = fopen("words.txt", "r");
-    assert_print(file_ptr, "Unable to find or open words.txt");
+  fseek(file_ptr, 0, SEEK_END);
+  long size = ftell(file_ptr);
+  fseek(file_ptr, 0, SEEK_SET);
 
-    fseek(file_ptr, 0, SEEK_END);
-    words_length = ftell(file_ptr) - WORD_LENGTH - 1;
-    fseek(file_ptr, 0, SEEK_SET);
-  }
+  char* text = malloc(size + 1);
+  assert_print(text, "Unable to allocate memory for words.txt");
+  size = fread(text, 1, size, file_ptr);
+  fclose(file_ptr);
+  text[size] = NULL_CHAR;
+
+  // Every word takes at least WORD_LENGTH bytes of the file
+  word_table = malloc(size / WORD_LENGTH * WORD_LENGTH + WORD_LENGTH);
+  assert_print(word_table, "Unable to allocate memory for words.txt");
 
-  fseek(file_ptr, rand() % words_length, SEEK_SET);
+  for (char* line = text; *line;) {
+    size_t length = strcspn(line, "\r\n");
+    bool is_word = length == WORD_LENGTH;
 
-  while ((ch = fgetc(file_ptr)) != EOF) {
-    if (ch == NEWLINE_CHAR) {
+    for (size_t i = 0; is_word && i < WORD_LENGTH; ++i)
+      is_word = isalpha((unsigned char) line[i]);
+
+    if (is_word) {
       for (size_t i = 0; i < WORD_LENGTH; ++i)
-        current_word[i] = toupper(fgetc(file_ptr));
-      return;
+        word_table[word_count * WORD_LENGTH + i] = toupper((unsigned char) line[i]);
+      ++word_count;
     }
+
+    line += length;
+    line += strspn(line, "\r\n");
   }
 
-  goto start_label;
+  free(text);
+  assert_print(word_count, "No words found in words.txt");
+}
+
+/**
+ * The code of an uppercase word: its letters as digits in base ALPHABET_SIZE.
+ *
+ * @param word The word, WORD_LENGTH uppercase letters.
+ * @return The code of the word, less than WORD_CODES.
+ */
+uint32_t word_code(const char* word) {
+  uint32_t code = 0;
+
+  for (size_t i = 0; i < WORD_LENGTH; ++i)
+    code = code * ALPHABET_SIZE + (word[i] - 'A');
+
+  return code;
+}
+
+/**
+ * Build the dictionary bitmap from the word table.
+ */
+void build_dictionary() {
+  dictionary = calloc(WORD_CODES / 8 + 1, 1);
+  assert_print(dictionary, "Unable to allocate memory for the dictionary");
+
+  for (size_t i = 0; i < word_count; ++i) {
+    uint32_t code = word_code(word_table + i * WORD_LENGTH);
+    dictionary[code / 8] |= 1 << (code % 8);
+  }
+}
+
+/**
+ * Check if an uppercase word is in the dictionary.
+ *
+ * @param word The word, WORD_LENGTH uppercase letters.
+ * @return true if the word is in words.txt; false otherwise.
+ */
+bool is_in_dictionary(const char* word) {
+  uint32_t code = word_code(word);
+
+  return dictionary[code / 8] >> (code % 8) & 1;
+}
+
+/**
+ * Assign a random word from the word table to the current word. Every word
+ * is equally likely: draws past the last whole multiple of word_count are
+ * thrown away.
+ */
+void assign_random_word() {
+  size_t limit = ((size_t) RAND_MAX + 1) / word_count * word_count;
+  size_t index;
+
+  do
+    index = (size_t) rand();
+  while (index >= limit);
+
+  memcpy(current_word, word_table + (index % word_count) * WORD_LENGTH, WORD_LENGTH);
 }
 
 /**
@@ -164,17 +290,18 @@ void string_toupper(char* str) {
 }
 
 /**
- * Validate if the input string meets the requirements for a valid guess.
+ * Validate if the input string meets the requirements for a valid guess:
+ * WORD_LENGTH letters that make a word of the dictionary.
  *
- * @param str The input string to validate.
+ * @param str The input string to validate, in uppercase.
  * @return true if the input is valid; false otherwise.
  */
 bool is_input_valid(const char* str) {
   for (int i = 0; i < WORD_LENGTH; ++i)
-    if (!str[i] || !isalpha(str[i]))
+    if (!str[i] || !isupper((unsigned char) str[i]))
       return false;
 
-  return !str[LAST_CHARACTER];
+  return !str[LAST_CHARACTER] && is_in_dictionary(str);
 }
 
 /**
@@ -190,7 +317,7 @@ void render() {
       printf(NEWLINE_STR);
 
     if (guess_list[i])
-      print_letter(guess_list[i], determine_letter_color(guess_list[i], letter_guess_array_index));
+      print_letter(guess_list[i], determine_letter_color(guess_patterns[i / WORD_LENGTH], letter_guess_array_index));
     else
       printf(LETTER_SEPERATOR_STR);
   }
@@ -276,17 +403,473 @@ void get_input() {
       user_input[i] = guess[i];
       guess_list[(WORD_LENGTH * current_line) + i] = guess[i];
     }
+    // Scored once, render() only looks the colors up
+    guess_patterns[current_line] = score_guess(guess, current_word);
     ++current_line;
   }
 }
 
+/*
+ * The solver of --solve and --simulate. pattern_matrix holds the pattern of
+ * every guess against every answer, a row per guess (guess * word_count +
+ * answer), so that scoring a guess against the remaining candidates reads
+ * one row in order. letter_masks, a bit per letter of each word, skips the
+ * pairs that share no letter while it is built. The work is shared out to a
+ * pool of threads, one per processor.
+ */
+#define MAX_SOLVER_THREADS 64
+#define MAX_SOLVE_GUESSES 32
+#define STRATEGY_COUNT 3
+
+enum { STRATEGY_ENTROPY, STRATEGY_CANDIDATES, STRATEGY_RANDOM };
+
+const char* strategy_names[STRATEGY_COUNT] = { "entropy", "candidates", "random" };
+
+uint8_t* pattern_matrix;
+uint32_t* letter_masks;
+
+// k * log2(k), for the entropy of a histogram of patterns
+double* count_log;
+
+// The best first guess, and the best second guess after each pattern of it
+size_t first_guess;
+size_t second_guesses[STRATEGY_COUNT][PATTERN_COUNT];
+
+// Simulated games: their answers, and the guesses each strategy took
+size_t* game_answers;
+size_t* game_guesses[STRATEGY_COUNT];
+size_t game_count;
+
+// Every word, the candidates before the first guess
+uint32_t* all_words;
+double* first_entropies;
+
+/*
+ * A thread of the pool: its own random seed and room for a list of
+ * candidates.
+ */
+typedef struct {
+  uint32_t seed;
+  uint32_t* candidates;
+} Worker;
+
+struct {
+#ifdef SOLVER_THREADS
+  atomic_size_t next;
+#else
+  size_t next;
+#endif
+  size_t count;
+  void (*work)(size_t item, Worker* worker);
+} pool;
+
+#ifdef SOLVER_THREADS
+#define next_item() atomic_fetch_add(&pool.next, 1)
+#else
+#define next_item() pool.next++
+#endif
+
+void* pool_worker(void* arg) {
+  Worker* worker = arg;
+  size_t item;
+
+  while ((item = next_item()) < pool.count)
+    pool.work(item, worker);
+
+  return NULL;
+}
+
+/**
+ * The next random number of a worker, from its own generator, so that
+ * the threads neither share the state of rand() nor need rand_r.
+ *
+ * @param worker The worker.
+ * @return A random number from 0 to 2^31 - 1.
+ */
+uint32_t next_random(Worker* worker) {
+  worker->seed = worker->seed * 1103515245u + 12345u;
+  return worker->seed >> 1;
+}
+
+/**
+ * Run work on the items 0 to count - 1, over a thread per processor, or
+ * on the calling thread only without SOLVER_THREADS.
+ *
+ * @param count The number of items.
+ * @param work The function to run on each item.
+ */
+void run_pool(size_t count, void (*work)(size_t, Worker*)) {
+  Worker workers[MAX_SOLVER_THREADS];
+  long processors = 1;
+  int started = 0;
+
+#if defined(SOLVER_THREADS) && defined(_SC_NPROCESSORS_ONLN)
+  processors = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  if (processors < 1)
+    processors = 1;
+  if (processors > MAX_SOLVER_THREADS)
+    processors = MAX_SOLVER_THREADS;
+
+  pool.next = 0;
+  pool.count = count;
+  pool.work = work;
+
+  for (long i = 0; i < processors; ++i) {
+    workers[i].seed = (uint32_t) rand();
+    workers[i].candidates = malloc(word_count * sizeof(uint32_t));
+    assert_print(workers[i].candidates, "Unable to allocate memory for the solver");
+  }
+
+#ifdef SOLVER_THREADS
+  pthread_t threads[MAX_SOLVER_THREADS];
+
+  for (; started < processors; ++started)
+    if (pthread_create(&threads[started], NULL, pool_worker, &workers[started]) != 0)
+      break;
+#endif
+
+  // Without threads, the work is done here
+  if (!started)
+    pool_worker(&workers[0]);
+
+#ifdef SOLVER_THREADS
+  for (int i = 0; i < started; ++i)
+    pthread_join(threads[i], NULL);
+#endif
+
+  for (long i = 0; i < processors; ++i)
+    free(workers[i].candidates);
+}
+
+void build_pattern_row(size_t guess, Worker* worker) {
+  const char* word = word_table + guess * WORD_LENGTH;
+  uint8_t* row = pattern_matrix + guess * word_count;
+  (void) worker;
+
+  for (size_t answer = 0; answer < word_count; ++answer)
+    row[answer] = letter_masks[guess] & letter_masks[answer]
+      ? score_guess(word, word_table + answer * WORD_LENGTH)
+      : 0;
+}
+
+/**
+ * The entropy of the patterns of a guess over the candidates.
+ *
+ * @param guess The index of the guess.
+ * @param candidates The remaining candidates, in increasing order.
+ * @param count The number of candidates.
+ * @return How much the guess is expected to tell, in bits.
+ */
+double guess_entropy(size_t guess, const uint32_t* candidates, size_t count) {
+  uint32_t histogram[PATTERN_COUNT] = {0};
+  const uint8_t* row = pattern_matrix + guess * word_count;
+  double sum = 0;
+
+  // A bucket going from k to k + 1 adds (k + 1) log (k + 1) - k log k
+  for (size_t i = 0; i < count; ++i) {
+    uint32_t k = histogram[row[candidates[i]]]++;
+    sum += count_log[k + 1] - count_log[k];
+  }
+
+  return log2((double) count) - sum / count;
+}
+
+/**
+ * Check if a word is one of the candidates.
+ *
+ * @param word The index of the word.
+ * @param candidates The remaining candidates, in increasing order.
+ * @param count The number of candidates.
+ * @return true if the word is a candidate; false otherwise.
+ */
+bool is_candidate(size_t word, const uint32_t* candidates, size_t count) {
+  size_t low = 0;
+
+  while (count > 1) {
+    size_t half = count / 2;
+    low = candidates[low + half] <= word ? low + half : low;
+    count -= half;
+  }
+
+  return count && candidates[low] == word;
+}
+
+/**
+ * Choose the next guess: the word with the most entropy over the
+ * candidates, among all the words or among the candidates only. A
+ * candidate also counts the chance of being the answer, so it wins ties.
+ * With one or two candidates left, the first one is guessed.
+ *
+ * @param strategy STRATEGY_ENTROPY or STRATEGY_CANDIDATES.
+ * @param candidates The remaining candidates, in increasing order.
+ * @param count The number of candidates.
+ * @return The index of the guess.
+ */
+size_t best_guess(int strategy, const uint32_t* candidates, size_t count) {
+  if (count <= 2)
+    return candidates[0];
+
+  size_t guesses = strategy == STRATEGY_ENTROPY ? word_count : count;
+  size_t best = candidates[0];
+  double best_score = -1;
+
+  for (size_t i = 0; i < guesses; ++i) {
+    size_t guess = strategy == STRATEGY_ENTROPY ? i : candidates[i];
+    double score = guess_entropy(guess, candidates, count);
+
+    if (strategy == STRATEGY_CANDIDATES || is_candidate(guess, candidates, count))
+      score += 1.0 / count;
+
+    if (score > best_score) {
+      best_score = score;
+      best = guess;
+    }
+  }
+
+  return best;
+}
+
+/**
+ * Keep the candidates that give the same pattern as the answer did.
+ *
+ * @param guess The index of the guess.
+ * @param pattern The pattern of the guess against the answer.
+ * @param candidates The candidates, filtered in place.
+ * @param count The number of candidates.
+ * @return The number of candidates left.
+ */
+size_t filter_candidates(size_t guess, uint8_t pattern, uint32_t* candidates, size_t count) {
+  const uint8_t* row = pattern_matrix + guess * word_count;
+  size_t left = 0;
+
+  for (size_t i = 0; i < count; ++i)
+    if (row[candidates[i]] == pattern)
+      candidates[left++] = candidates[i];
+
+  return left;
+}
+
+/**
+ * Play a game with a strategy until the answer is found.
+ *
+ * @param answer The index of the answer.
+ * @param strategy The strategy.
+ * @param worker The thread playing it.
+ * @param guesses The guesses made, up to MAX_SOLVE_GUESSES of them, or NULL.
+ * @return The number of guesses it took.
+ */
+size_t play_solver(size_t answer, int strategy, Worker* worker, size_t* guesses) {
+  uint32_t* candidates = worker->candidates;
+  size_t count = word_count, first_pattern = 0;
+
+  memcpy(candidates, all_words, word_count * sizeof(uint32_t));
+
+  for (size_t turn = 1;; ++turn) {
+    size_t guess;
+
+    if (strategy == STRATEGY_RANDOM)
+      guess = candidates[next_random(worker) % count];
+    else if (turn == 1)
+      guess = first_guess;
+    else if (turn == 2)
+      guess = second_guesses[strategy][first_pattern];
+    else
+      guess = best_guess(strategy, candidates, count);
+
+    if (guesses && turn <= MAX_SOLVE_GUESSES)
+      guesses[turn - 1] = guess;
+
+    uint8_t pattern = pattern_matrix[guess * word_count + answer];
+
+    if (pattern == PATTERN_SOLVED)
+      return turn;
+
+    if (turn == 1)
+      first_pattern = pattern;
+    count = filter_candidates(guess, pattern, candidates, count);
+  }
+}
+
+void rate_first_guess(size_t guess, Worker* worker) {
+  (void) worker;
+  first_entropies[guess] = guess_entropy(guess, all_words, word_count);
+}
+
+void choose_second_guess(size_t item, Worker* worker) {
+  int strategy = item / PATTERN_COUNT;
+  uint8_t pattern = item % PATTERN_COUNT;
+  size_t count;
+
+  memcpy(worker->candidates, all_words, word_count * sizeof(uint32_t));
+  count = filter_candidates(first_guess, pattern, worker->candidates, word_count);
+  if (count)
+    second_guesses[strategy][pattern] = best_guess(strategy, worker->candidates, count);
+}
+
+void simulate_game(size_t item, Worker* worker) {
+  int strategy = item % STRATEGY_COUNT;
+  size_t game = item / STRATEGY_COUNT;
+
+  game_guesses[strategy][game] = play_solver(game_answers[game], strategy, worker, NULL);
+}
+
+/**
+ * Build the pattern matrix, then choose the first guess and the second
+ * guesses of the entropy strategies, which every game shares.
+ */
+void prepare_solver() {
+  letter_masks = malloc(word_count * sizeof(uint32_t));
+  count_log = malloc((word_count + 1) * sizeof(double));
+  pattern_matrix = malloc(word_count * word_count);
+  all_words = malloc(word_count * sizeof(uint32_t));
+  first_entropies = malloc(word_count * sizeof(double));
+  assert_print(letter_masks && count_log && pattern_matrix && all_words && first_entropies,
+               "Unable to allocate memory for the solver");
+
+  for (size_t i = 0; i < word_count; ++i) {
+    all_words[i] = i;
+    letter_masks[i] = 0;
+    for (size_t j = 0; j < WORD_LENGTH; ++j)
+      letter_masks[i] |= 1u << (word_table[i * WORD_LENGTH + j] - 'A');
+  }
+
+  count_log[0] = 0;
+  for (size_t k = 1; k <= word_count; ++k)
+    count_log[k] = k * log2((double) k);
+
+  run_pool(word_count, build_pattern_row);
+
+  run_pool(word_count, rate_first_guess);
+
+  first_guess = 0;
+  for (size_t i = 1; i < word_count; ++i)
+    if (first_entropies[i] > first_entropies[first_guess])
+      first_guess = i;
+
+  // The random strategy has no use for them
+  run_pool(STRATEGY_RANDOM * PATTERN_COUNT, choose_second_guess);
+}
+
 /**
- * Main function to initialize the game and enter the game loop.
+ * Play every word once, or count random words, with each strategy and
+ * print how many guesses they took.
  *
+ * @param count The number of games, 0 for every word once.
+ */
+void simulate(size_t count) {
+  game_count = count ? count : word_count;
+  game_answers = malloc(game_count * sizeof(size_t));
+  assert_print(game_answers, "Unable to allocate memory for the simulation");
+  for (int s = 0; s < STRATEGY_COUNT; ++s) {
+    game_guesses[s] = malloc(game_count * sizeof(size_t));
+    assert_print(game_guesses[s], "Unable to allocate memory for the simulation");
+  }
+
+  for (size_t i = 0; i < game_count; ++i)
+    game_answers[i] = count ? (size_t) rand() % word_count : i;
+
+  prepare_solver();
+  run_pool(game_count * STRATEGY_COUNT, simulate_game);
+
+  printf("First guess: %.*s (%.3f bits)\n\n", WORD_LENGTH,
+         word_table + first_guess * WORD_LENGTH, first_entropies[first_guess]);
+  printf("%-12s %8s %8s %6s %6s\n", "strategy", "games", "average", "worst", "lost");
+
+  for (int s = 0; s < STRATEGY_COUNT; ++s) {
+    size_t total = 0, worst = 0, lost = 0;
+
+    for (size_t i = 0; i < game_count; ++i) {
+      size_t guesses = game_guesses[s][i];
+      total += guesses;
+      worst = guesses > worst ? guesses : worst;
+      lost += guesses > MAX_GUESSES;
+    }
+
+    printf("%-12s %8zu %8.4f %6zu %6zu\n", strategy_names[s], game_count,
+           (double) total / game_count, worst, lost);
+  }
+
+  free(game_answers);
+  for (int s = 0; s < STRATEGY_COUNT; ++s)
+    free(game_guesses[s]);
+}
+
+/**
+ * Print the guesses of the entropy strategy for an answer, colored as in
+ * the game.
+ *
+ * @param word The answer.
+ */
+void solve(char* word) {
+  size_t guesses[MAX_SOLVE_GUESSES];
+  Worker worker = { 0, malloc(word_count * sizeof(uint32_t)) };
+
+  assert_print(worker.candidates, "Unable to allocate memory for the solver");
+  string_toupper(word);
+  if (!is_input_valid(word)) {
+    printf("%s is not in the word list\n", word);
+    free(worker.candidates);
+    terminate(1);
+  }
+
+  prepare_solver();
+
+  size_t answer = 0;
+  while (memcmp(word_table + answer * WORD_LENGTH, word, WORD_LENGTH))
+    ++answer;
+
+  size_t turns = play_solver(answer, STRATEGY_ENTROPY, &worker, guesses);
+
+  for (size_t turn = 0; turn < turns && turn < MAX_SOLVE_GUESSES; ++turn) {
+    const char* guess = word_table + guesses[turn] * WORD_LENGTH;
+    uint8_t pattern = pattern_matrix[guesses[turn] * word_count + answer];
+
+    for (size_t i = 0; i < WORD_LENGTH; ++i)
+      print_letter(guess[i], determine_letter_color(pattern, i));
+    printf("%s", COLOR_DEFAULT_TEXT NEWLINE_STR);
+  }
+
+  printf("Solved in %zu guesses\n", turns);
+  free(worker.candidates);
+}
+
+/**
+ * Main function to initialize the game and enter the game loop, or to run
+ * the solver with --solve WORD or --simulate[=N].
+ *
+ * @param argc The number of arguments.
+ * @param argv The arguments.
  * @return Exit status code.
  */
-int main() {
+int main(int argc, char** argv) {
   srand(time(NULL));
+  load_words();
+  build_dictionary();
+
+  if (argc == 3 && !strcmp(argv[1], "--solve")) {
+    solve(argv[2]);
+    terminate(0);
+  }
+
+  if (argc == 2 && !strncmp(argv[1], "--simulate", 10)) {
+    char* end = argv[1] + 10;
+    size_t count = 0;
+
+    // N is a positive number, nothing else
+    if (*end == '=' && isdigit((unsigned char) end[1]))
+      count = strtoul(end + 1, &end, 10);
+
+    if (!*end && (count || !argv[1][10])) {
+      simulate(count);
+      terminate(0);
+    }
+  }
+
+  if (argc > 1) {
+    printf("Usage: %s [--solve WORD | --simulate[=N]]\n", argv[0]);
+    terminate(1);
+  }
 
   printf("%s", COLOR_DEFAULT_TEXT);
   printf("SWORDLE - A Wordle Game written in C\n");
@@ -299,13 +882,18 @@ int main() {
 }
 
 /**
- * Terminate the program, closing any open files and exiting with the given code.
+ * Terminate the program, freeing the word table and exiting with the given code.
  *
  * @param exit_code The exit code to return.
  */
 void terminate(uint8_t exit_code) {
-  if (file_ptr)
-    fclose(file_ptr);
+  free(word_table);
+  free(dictionary);
+  free(pattern_matrix);
+  free(letter_masks);
+  free(count_log);
+  free(all_words);
+  free(first_entropies);
 
   exit(exit_code);
 }